@@ -0,0 +1,92 @@
+#include "memory.h"
+#include "stdio.h"
+#include "time.h"
+
+#define BUDDY_BENCH_SLOTS 256
+#define BUDDY_BENCH_STEPS 1000000
+
+
+struct buddy_bench_slot {
+	struct page *pages;
+	int order;
+};
+
+/* mostly small requests with an occasional large one */
+static const int buddy_bench_order[] = {
+	0, 0, 0, 0, 0, 0, 1, 1, 1, 2, 2, 3, 4, 5, 6, 8
+};
+
+static unsigned long buddy_bench_rand(unsigned long *state)
+{
+	unsigned long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void buddy_bench_run(bool lazy)
+{
+	static struct buddy_bench_slot slot[BUDDY_BENCH_SLOTS];
+	unsigned long long allocs = 0, frees = 0, fails = 0;
+	unsigned long state = 42;
+	struct buddy_stats before, after;
+
+	set_lazy_buddy(lazy);
+	drain_pages();
+	buddy_stats(&before);
+
+	const unsigned long long ticks = jiffies;
+	const unsigned long long cycles = rdtsc();
+
+	for (int i = 0; i != BUDDY_BENCH_STEPS; ++i) {
+		const unsigned long r = buddy_bench_rand(&state);
+		struct buddy_bench_slot *s = &slot[r % BUDDY_BENCH_SLOTS];
+
+		if (s->pages) {
+			free_pages(s->pages, s->order);
+			s->pages = 0;
+			++frees;
+			continue;
+		}
+
+		s->order = buddy_bench_order[(r >> 8) %
+					ARRAY_SIZE(buddy_bench_order)];
+		s->pages = alloc_pages(s->order);
+		if (s->pages)
+			++allocs;
+		else
+			++fails;
+	}
+
+	const unsigned long long elapsed = rdtsc() - cycles;
+	const unsigned long long ms = (jiffies - ticks) * 1000 / HZ;
+
+	for (int i = 0; i != BUDDY_BENCH_SLOTS; ++i) {
+		free_pages(slot[i].pages, slot[i].order);
+		slot[i].pages = 0;
+	}
+	buddy_stats(&after);
+
+	DBG_INFO("%s: %llu allocs, %llu frees, %llu failures in %llu ms",
+		lazy ? "lazy" : "eager", allocs, frees, fails, ms);
+	DBG_INFO("%s: %llu cycles/op, %lu splits, %lu merges, %lu lazy hits",
+		lazy ? "lazy" : "eager", elapsed / BUDDY_BENCH_STEPS,
+		after.splits - before.splits, after.merges - before.merges,
+		after.lazy_hits - before.lazy_hits);
+}
+
+void buddy_bench(void)
+{
+	DBG_INFO("Start buddy alloc/free storm benchmark");
+	buddy_bench_run(false);
+	buddy_bench_run(true);
+#ifdef CONFIG_LAZY_BUDDY
+	set_lazy_buddy(true);
+#else
+	set_lazy_buddy(false);
+#endif
+	dump_buddy_state();
+	DBG_INFO("Buddy benchmark finished");
+}
@@ -0,0 +1,18 @@
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#ifdef CONFIG_NR_CPUS
+#define NR_CPUS CONFIG_NR_CPUS
+#else
+#define NR_CPUS 1
+#endif
+
+/*
+ * We don't bring up application processors (yet), so the only cpu
+ * we ever run on is the bootstrap one. Per-cpu data must still be
+ * accessed with preemption disabled.
+ */
+static inline int cpu_id(void)
+{ return 0; }
+
+#endif /*__CPU_H__*/
@@ -12,6 +12,7 @@ static const char *err_str[] = {
 	"IO error",
 	"Exec format error",
 	"No such system call",
+	"Bad address",
 	"Unknown error"
 };
 
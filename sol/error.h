@@ -10,6 +10,7 @@
 #define EIO     7
 #define ENOEXEC 8
 #define ENOSYS  9
+#define EFAULT  10
 
 #ifndef __ASM_FILE__
 
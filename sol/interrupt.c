@@ -5,6 +5,7 @@
 #include "irqchip.h"
 #include "memory.h"
 #include "string.h"
+#include "mm.h"
 #include "stdio.h"
 #include "error.h"
 
@@ -16,6 +17,7 @@
 #define IDT_USER       ((uint64_t)3 << 45)
 #define IDT_IRQS       16
 #define IDT_EXCEPTIONS 32
+#define IDT_PAGE_FAULT 14
 #define IDT_SIZE       (IDT_IRQS + IDT_EXCEPTIONS)
 
 
@@ -152,10 +154,34 @@ static inline void unmask_irq(int irq)
 static inline void ack_irq(int irq)
 { irqchip_eoi(irqchip, irq); }
 
+static int page_fault_handler(const struct thread_regs *frame)
+{
+	const virt_t addr = load_cr2();
+	struct thread *thread = current();
+
+	/*
+	 * Faults might sleep (readpage takes the node rwsem) and allocate
+	 * memory, so they can't be handled if the faulting context had
+	 * interrupts (and so preemption) disabled.
+	 */
+	if (!thread || !(frame->rflags & RFLAGS_IF))
+		return -EFAULT;
+
+	local_irq_enable();
+
+	const int rc = mm_page_fault(thread->mm, addr, frame->error);
+
+	local_irq_disable();
+	return rc;
+}
+
 void isr_common_handler(struct thread_regs *ctx)
 {
 	const int intno = ctx->intno;
 
+	if (intno == IDT_PAGE_FAULT && !page_fault_handler(ctx))
+		return;
+
 	if (intno < IDT_EXCEPTIONS) {
 		default_exception_handler(ctx);
 		return;
@@ -43,11 +43,9 @@ static inline uintmax_t ALIGN(uintmax_t x, uintmax_t a)
 
 static inline int ilog2(uintmax_t x)
 {
-	int order = 0;
-
-	while ((x >>= 1))
-		++order;
-	return order;
+	if (!x)
+		return 0;
+	return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(x);
 }
 
 #endif /*__KERNEL_H__*/
@@ -3,5 +3,10 @@
 
 //#define CONFIG_QEMU_GDB_HANG      /* infinite loop after long mode enabled */
 #define CONFIG_RAMFS_TEST
+//#define CONFIG_LAZY_BUDDY         /* defer buddy merging on free */
+//#define CONFIG_MEMORY_NODE_SIZE   (256ul * 1024ul * 1024ul) /* fake nodes */
+//#define CONFIG_KMEM_BENCH         /* kmem_cache benchmarks */
+//#define CONFIG_BUDDY_BENCH        /* buddy alloc/free storm benchmark */
+//#define CONFIG_VFS_BENCH          /* 1M path lookups in the initramfs */
 
 #endif /*__KERNEL_CONFIG_H__*/
@@ -0,0 +1,286 @@
+#include "threads_defs.h"
+#include "kmem_cache.h"
+#include "rbtree.h"
+#include "stdio.h"
+#include "time.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KMEM_BENCH_BATCH  16
+#define KMEM_BENCH_ROUNDS 4096
+
+#define COLOR_BENCH_NODES   32768
+#define COLOR_BENCH_LOOKUPS 1000000
+#define COLOR_BENCH_SIZE    504
+#define COLOR_BENCH_ALIGN   64
+
+
+struct kmem_bench_result {
+	unsigned long long cycles;
+	unsigned long long ticks;
+	unsigned long long ops;
+};
+
+static void kmem_bench_cache(struct kmem_cache *cache,
+			struct kmem_bench_result *res)
+{
+	void *ptr[KMEM_BENCH_BATCH];
+
+	const unsigned long long ticks = jiffies;
+	const unsigned long long cycles = rdtsc();
+
+	for (int i = 0; i != KMEM_BENCH_ROUNDS; ++i) {
+		for (int j = 0; j != KMEM_BENCH_BATCH; ++j)
+			ptr[j] = kmem_cache_alloc(cache);
+
+		for (int j = 0; j != KMEM_BENCH_BATCH; ++j)
+			kmem_cache_free(cache, ptr[j]);
+	}
+
+	res->cycles = rdtsc() - cycles;
+	res->ticks = jiffies - ticks;
+	res->ops = 2ull * KMEM_BENCH_ROUNDS * KMEM_BENCH_BATCH;
+}
+
+static unsigned long long kmem_bench_ops_per_sec(
+			const struct kmem_bench_result *res)
+{
+	if (!res->ticks)
+		return 0;
+	return res->ops * HZ / res->ticks;
+}
+
+static int kmem_bench_size(size_t size, unsigned long flags,
+			struct kmem_bench_result *res)
+{
+	struct kmem_cache *cache = kmem_cache_create(size, sizeof(void *),
+				flags);
+
+	if (!cache)
+		return -1;
+
+	/* the first run is a warm up, so we don't measure slab creation */
+	kmem_bench_cache(cache, res);
+	kmem_bench_cache(cache, res);
+	kmem_cache_destroy(cache);
+	return 0;
+}
+
+void kmem_bench(void)
+{
+	DBG_INFO("Start kmem_cache benchmark");
+	DBG_INFO("size: cycles/op (ops/sec) with/without magazines");
+
+	for (int i = 0; i != kmem_pools(); ++i) {
+		const size_t size = kmem_pool_size(i);
+		struct kmem_bench_result mag, nomag;
+
+		if (kmem_bench_size(size, 0, &mag) ||
+				kmem_bench_size(size, KMEM_NOMAGAZINE, &nomag)) {
+			DBG_ERR("failed to create cache for size %lu",
+				(unsigned long)size);
+			continue;
+		}
+
+		DBG_INFO("%lu: %llu (%llu) / %llu (%llu)",
+			(unsigned long)size,
+			mag.cycles / mag.ops, kmem_bench_ops_per_sec(&mag),
+			nomag.cycles / nomag.ops,
+			kmem_bench_ops_per_sec(&nomag));
+	}
+	DBG_INFO("kmem_cache benchmark finished");
+}
+
+
+/*
+ * This is a port of lec2/bench-color: rb tree lookups where only the
+ * first cache line of every (large) node is touched. Without coloring
+ * these lines of different slabs all map to the same few cache sets.
+ */
+struct color_bench_node {
+	struct rb_node node;
+	unsigned long value;
+};
+
+#define IA32_PERFEVTSEL0 0x186
+#define IA32_PMC0        0xc1
+#define LLC_MISSES       0x412e
+#define PERFEVTSEL_OS    BIT_CONST(17)
+#define PERFEVTSEL_EN    BIT_CONST(22)
+
+static void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx)
+{
+	uint32_t ecx = 0, edx;
+
+	__asm__ volatile ("cpuid"
+		: "=a"(*eax), "=b"(*ebx), "+c"(ecx), "=d"(edx)
+		: "a"(leaf));
+}
+
+static uint64_t rdmsr(uint32_t msr)
+{
+	uint32_t lo, hi;
+
+	__asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+	return (uint64_t)hi << 32 | lo;
+}
+
+static void wrmsr(uint32_t msr, uint64_t value)
+{
+	const uint32_t lo = value, hi = value >> 32;
+
+	__asm__ volatile ("wrmsr" : : "a"(lo), "d"(hi), "c"(msr));
+}
+
+/* architectural LLC misses event might be unavailable (e.g. under TCG) */
+static bool llc_misses_available(void)
+{
+	uint32_t eax, ebx;
+
+	cpuid(0, &eax, &ebx);
+	if (eax < 0xa)
+		return false;
+
+	cpuid(0xa, &eax, &ebx);
+	if ((eax & 0xff) == 0 || ((eax >> 8) & 0xff) == 0)
+		return false;
+
+	/* bit 4 set means the event is NOT available */
+	return (eax >> 24) > 4 && !(ebx & BIT_CONST(4));
+}
+
+static void llc_misses_start(void)
+{
+	wrmsr(IA32_PERFEVTSEL0, 0);
+	wrmsr(IA32_PMC0, 0);
+	wrmsr(IA32_PERFEVTSEL0, LLC_MISSES | PERFEVTSEL_OS | PERFEVTSEL_EN);
+}
+
+static uint64_t llc_misses_stop(void)
+{
+	wrmsr(IA32_PERFEVTSEL0, 0);
+	return rdmsr(IA32_PMC0);
+}
+
+static unsigned long color_bench_rand(unsigned long *state)
+{
+	unsigned long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void color_bench_insert(struct rb_tree *tree,
+			struct color_bench_node *node)
+{
+	struct rb_node **plink = &tree->root;
+	struct rb_node *parent = 0;
+
+	while (*plink) {
+		struct color_bench_node *x = TREE_ENTRY(*plink,
+					struct color_bench_node, node);
+
+		parent = *plink;
+		if (x->value < node->value)
+			plink = &parent->right;
+		else
+			plink = &parent->left;
+	}
+
+	rb_link(&node->node, parent, plink);
+	rb_insert(&node->node, tree);
+}
+
+static struct color_bench_node *color_bench_lookup(struct rb_tree *tree,
+			unsigned long value)
+{
+	struct rb_node *ptr = tree->root;
+
+	while (ptr) {
+		struct color_bench_node *x = TREE_ENTRY(ptr,
+					struct color_bench_node, node);
+
+		if (x->value == value)
+			return x;
+
+		if (x->value < value)
+			ptr = ptr->right;
+		else
+			ptr = ptr->left;
+	}
+	return 0;
+}
+
+static void color_bench_release(struct kmem_cache *cache, struct rb_node *node)
+{
+	while (node) {
+		struct color_bench_node *x = TREE_ENTRY(node,
+					struct color_bench_node, node);
+
+		color_bench_release(cache, node->right);
+		node = node->left;
+		kmem_cache_free(cache, x);
+	}
+}
+
+static void color_bench_run(unsigned long flags, const char *name)
+{
+	struct kmem_cache *cache = kmem_cache_create(COLOR_BENCH_SIZE,
+				COLOR_BENCH_ALIGN, flags);
+	const bool pmc = llc_misses_available();
+	struct rb_tree tree = { 0 };
+	unsigned long state = 42;
+
+	if (!cache) {
+		DBG_ERR("failed to create cache");
+		return;
+	}
+
+	for (int i = 0; i != COLOR_BENCH_NODES; ++i) {
+		struct color_bench_node *node = kmem_cache_alloc(cache);
+
+		if (!node)
+			break;
+
+		node->value = color_bench_rand(&state);
+		color_bench_insert(&tree, node);
+	}
+
+	if (pmc)
+		llc_misses_start();
+
+	const unsigned long long cycles = rdtsc();
+
+	for (int i = 0; i != COLOR_BENCH_LOOKUPS; ++i) {
+		struct color_bench_node *node =
+			color_bench_lookup(&tree, color_bench_rand(&state));
+
+		barrier();
+		(void) node;
+	}
+
+	const unsigned long long elapsed = rdtsc() - cycles;
+
+	if (pmc) {
+		const unsigned long long misses = llc_misses_stop();
+
+		DBG_INFO("%s: %llu cycles, %llu LLC misses", name, elapsed,
+			misses);
+	} else {
+		DBG_INFO("%s: %llu cycles", name, elapsed);
+	}
+
+	color_bench_release(cache, tree.root);
+	kmem_cache_destroy(cache);
+}
+
+void kmem_color_bench(void)
+{
+	DBG_INFO("Start slab coloring benchmark");
+	color_bench_run(0, "no coloring");
+	color_bench_run(KMEM_COLOR, "coloring");
+	DBG_INFO("Slab coloring benchmark finished");
+}
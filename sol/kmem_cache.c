@@ -3,6 +3,12 @@
 #include "memory.h"
 #include "stdio.h"
 #include "list.h"
+#include "cpu.h"
+
+#define KMEM_MAGAZINE_SIZE 16
+#define KMEM_CACHE_LINE    64
+#define KMEM_GROW_BATCH    4
+#define KMEM_FREE_BATCH    16
 
 
 struct kmem_slab_ops {
@@ -24,8 +30,31 @@ struct kmem_cache_ops {
 	void (*destroy)(struct kmem_cache *, struct kmem_slab *);
 };
 
+/**
+ * Magazine is just a stack of free objects, every cpu has two of
+ * them (loaded and previous) and the rest are kept in the cache depot.
+ * Previous magazine is always either full or empty, so when loaded
+ * magazine runs out we just swap them and only go to the depot if
+ * the swap doesn't help.
+ */
+struct kmem_magazine {
+	struct list_head link;
+	size_t rounds;
+	void *round[KMEM_MAGAZINE_SIZE];
+};
+
+struct kmem_cpu_cache {
+	struct kmem_magazine *loaded;
+	struct kmem_magazine *previous;
+};
+
 struct kmem_cache {
 	const struct kmem_cache_ops *ops;
+	struct kmem_cpu_cache cpu[NR_CPUS];
+	struct list_head full_magazines; // protected by depot_lock
+	struct list_head empty_magazines; // protected by depot_lock
+	struct spinlock depot_lock;
+	size_t magazine_size;
 	struct list_head part_list;
 	struct list_head free_list;
 	struct list_head full_list;
@@ -35,64 +64,98 @@ struct kmem_cache {
 	int order;
 };
 
+static struct kmem_cache *kmem_magazine_cache;
+
 
-static void kmem_cache_init(struct kmem_cache *cache)
+static void kmem_cache_init(struct kmem_cache *cache, size_t objects,
+			unsigned long flags)
 {
+	for (int i = 0; i != NR_CPUS; ++i) {
+		cache->cpu[i].loaded = 0;
+		cache->cpu[i].previous = 0;
+	}
+	list_init(&cache->full_magazines);
+	list_init(&cache->empty_magazines);
+	spinlock_init(&cache->depot_lock);
+
+	if (flags & KMEM_NOMAGAZINE)
+		cache->magazine_size = 0;
+	else
+		cache->magazine_size = MINU(objects, KMEM_MAGAZINE_SIZE);
+
 	list_init(&cache->free_list);
 	list_init(&cache->part_list);
 	list_init(&cache->full_list);
 	spinlock_init(&cache->lock);
 }
 
+/**
+ * A cache of small slabs that already has full slabs is likely to keep
+ * growing, so it gets KMEM_GROW_BATCH slabs at once from a single bulk
+ * page allocation.
+ */
 static bool kmem_cache_grow(struct kmem_cache *cache)
 {
 	const pfn_t pfs = (pfn_t)1 << cache->order;
-	struct page *pages = alloc_pages(cache->order);
+	const int batch = (cache->order < PCP_ORDERS &&
+				!list_empty(&cache->full_list))
+				? KMEM_GROW_BATCH : 1;
+	struct page *slab_pages[KMEM_GROW_BATCH];
+	const int count = alloc_pages_bulk(cache->order, batch, slab_pages);
+	int grown = 0;
+
+	for (; grown != count; ++grown) {
+		struct page *pages = slab_pages[grown];
+		struct kmem_slab *slab = cache->ops->create(cache, pages);
+
+		if (!slab) {
+			free_pages_bulk(cache->order, count - grown,
+						slab_pages + grown);
+			break;
+		}
 
-	if (!pages)
-		return false;
+		for (pfn_t i = 0; i != pfs; ++i)
+			pages[i].u.slab = slab;
 
-	struct kmem_slab *slab = cache->ops->create(cache, pages);
+		slab->cache = cache;
+		slab->pages = pages;
 
-	if (!slab) {
-		free_pages(pages, cache->order);
-		return false;
+		const bool enabled = spin_lock_irqsave(&cache->lock);
+		list_add(&slab->link, &cache->free_list);
+		spin_unlock_irqrestore(&cache->lock, enabled);
 	}
 
-	for (pfn_t i = 0; i != pfs; ++i)
-		pages[i].u.slab = slab;
-
-	slab->cache = cache;
-	slab->pages = pages;
-
-	const bool enabled = spin_lock_irqsave(&cache->lock);
-	list_add(&slab->link, &cache->free_list);
-	spin_unlock_irqrestore(&cache->lock, enabled);
-
-	return true;
+	return grown != 0;
 }
 
-void kmem_cache_reap(struct kmem_cache *cache)
+static void kmem_cache_release_slabs(struct kmem_cache *cache)
 {
 	LIST_HEAD(list);
 	const bool enabled = spin_lock_irqsave(&cache->lock);
 	list_splice(&cache->free_list, &list);
 	spin_unlock_irqrestore(&cache->lock, enabled);
 
+	struct page *slab_pages[KMEM_FREE_BATCH];
+	int count = 0;
+
 	for (struct list_head *ptr = list.next; ptr != &list;) {
 		struct kmem_slab *slab =
 			LIST_ENTRY(ptr, struct kmem_slab, link);
-		struct page *pages = slab->pages;
+
+		if (count == KMEM_FREE_BATCH) {
+			free_pages_bulk(cache->order, count, slab_pages);
+			count = 0;
+		}
+		slab_pages[count++] = slab->pages;
 
 		ptr = ptr->next;
 		if (cache->ops->destroy)
 			cache->ops->destroy(cache, slab);
-
-		free_pages(pages, cache->order);	
 	}
+	free_pages_bulk(cache->order, count, slab_pages);
 }
 
-void *kmem_cache_alloc(struct kmem_cache *cache)
+static void *__kmem_cache_alloc(struct kmem_cache *cache)
 {
 	const bool enabled = spin_lock_irqsave(&cache->lock);
 
@@ -139,7 +202,7 @@ static struct kmem_slab *kmem_get_slab(void *ptr)
 	return pfn2page(pfn)->u.slab;
 }
 
-void kmem_cache_free(struct kmem_cache *cache, void *ptr)
+static void __kmem_cache_free(struct kmem_cache *cache, void *ptr)
 {
 	struct kmem_slab *slab = kmem_get_slab(ptr);
 	const bool enabled = spin_lock_irqsave(&cache->lock);
@@ -162,6 +225,204 @@ void kmem_cache_free(struct kmem_cache *cache, void *ptr)
 }
 
 
+static void *kmem_magazine_pop(struct kmem_magazine *mag)
+{ return mag->round[--mag->rounds]; }
+
+static void kmem_magazine_push(struct kmem_magazine *mag, void *ptr)
+{ mag->round[mag->rounds++] = ptr; }
+
+static struct kmem_magazine *kmem_magazine_alloc(void)
+{
+	struct kmem_magazine *mag = __kmem_cache_alloc(kmem_magazine_cache);
+
+	if (mag) {
+		list_init(&mag->link);
+		mag->rounds = 0;
+	}
+	return mag;
+}
+
+static void kmem_magazine_release(struct kmem_cache *cache,
+			struct kmem_magazine *mag)
+{
+	if (!mag)
+		return;
+
+	while (mag->rounds)
+		__kmem_cache_free(cache, kmem_magazine_pop(mag));
+	__kmem_cache_free(kmem_magazine_cache, mag);
+}
+
+static struct kmem_magazine *kmem_depot_get(struct kmem_cache *cache,
+			struct list_head *list)
+{
+	struct kmem_magazine *mag = 0;
+	const bool enabled = spin_lock_irqsave(&cache->depot_lock);
+
+	if (!list_empty(list)) {
+		mag = LIST_ENTRY(list_first(list), struct kmem_magazine, link);
+		list_del(&mag->link);
+	}
+	spin_unlock_irqrestore(&cache->depot_lock, enabled);
+
+	return mag;
+}
+
+static void kmem_depot_put(struct kmem_cache *cache, struct kmem_magazine *mag)
+{
+	if (!mag)
+		return;
+
+	const bool enabled = spin_lock_irqsave(&cache->depot_lock);
+
+	if (mag->rounds)
+		list_add(&mag->link, &cache->full_magazines);
+	else
+		list_add(&mag->link, &cache->empty_magazines);
+	spin_unlock_irqrestore(&cache->depot_lock, enabled);
+}
+
+static void kmem_depot_drain(struct kmem_cache *cache)
+{
+	LIST_HEAD(list);
+	const bool enabled = spin_lock_irqsave(&cache->depot_lock);
+
+	list_splice(&cache->full_magazines, &list);
+	list_splice(&cache->empty_magazines, &list);
+	spin_unlock_irqrestore(&cache->depot_lock, enabled);
+
+	for (struct list_head *ptr = list.next; ptr != &list;) {
+		struct kmem_magazine *mag =
+			LIST_ENTRY(ptr, struct kmem_magazine, link);
+
+		ptr = ptr->next;
+		kmem_magazine_release(cache, mag);
+	}
+}
+
+static void kmem_cpu_cache_swap(struct kmem_cpu_cache *cpu)
+{
+	struct kmem_magazine *mag = cpu->loaded;
+
+	cpu->loaded = cpu->previous;
+	cpu->previous = mag;
+}
+
+static void *kmem_cpu_cache_alloc(struct kmem_cache *cache)
+{
+	struct kmem_cpu_cache *cpu = &cache->cpu[cpu_id()];
+
+	if (cpu->loaded && cpu->loaded->rounds)
+		return kmem_magazine_pop(cpu->loaded);
+
+	if (cpu->previous && cpu->previous->rounds) {
+		kmem_cpu_cache_swap(cpu);
+		return kmem_magazine_pop(cpu->loaded);
+	}
+
+	struct kmem_magazine *full = kmem_depot_get(cache,
+				&cache->full_magazines);
+
+	if (!full)
+		return 0;
+
+	kmem_depot_put(cache, cpu->previous);
+	cpu->previous = cpu->loaded;
+	cpu->loaded = full;
+
+	return kmem_magazine_pop(full);
+}
+
+static bool kmem_cpu_cache_free(struct kmem_cache *cache, void *ptr)
+{
+	struct kmem_cpu_cache *cpu = &cache->cpu[cpu_id()];
+	const size_t size = cache->magazine_size;
+
+	if (cpu->loaded && cpu->loaded->rounds != size) {
+		kmem_magazine_push(cpu->loaded, ptr);
+		return true;
+	}
+
+	if (cpu->previous && !cpu->previous->rounds) {
+		kmem_cpu_cache_swap(cpu);
+		kmem_magazine_push(cpu->loaded, ptr);
+		return true;
+	}
+
+	struct kmem_magazine *empty = kmem_depot_get(cache,
+				&cache->empty_magazines);
+
+	if (!empty)
+		empty = kmem_magazine_alloc();
+
+	if (!empty)
+		return false;
+
+	kmem_depot_put(cache, cpu->previous);
+	cpu->previous = cpu->loaded;
+	cpu->loaded = empty;
+	kmem_magazine_push(empty, ptr);
+
+	return true;
+}
+
+/*
+ * Caller must guarantee that nobody uses the cache concurrently, since
+ * we steal magazines from other cpus without any synchronization.
+ */
+static void kmem_cpu_cache_drain(struct kmem_cache *cache)
+{
+	for (int i = 0; i != NR_CPUS; ++i) {
+		struct kmem_cpu_cache *cpu = &cache->cpu[i];
+		const bool enabled = local_preempt_save();
+		struct kmem_magazine *loaded = cpu->loaded;
+		struct kmem_magazine *previous = cpu->previous;
+
+		cpu->loaded = cpu->previous = 0;
+		local_preempt_restore(enabled);
+
+		kmem_magazine_release(cache, loaded);
+		kmem_magazine_release(cache, previous);
+	}
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	if (cache->magazine_size) {
+		const bool enabled = local_preempt_save();
+		void *ptr = kmem_cpu_cache_alloc(cache);
+
+		local_preempt_restore(enabled);
+
+		if (ptr)
+			return ptr;
+	}
+
+	return __kmem_cache_alloc(cache);
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+	if (cache->magazine_size) {
+		const bool enabled = local_preempt_save();
+		const bool cached = kmem_cpu_cache_free(cache, ptr);
+
+		local_preempt_restore(enabled);
+
+		if (cached)
+			return;
+	}
+
+	__kmem_cache_free(cache, ptr);
+}
+
+void kmem_cache_reap(struct kmem_cache *cache)
+{
+	kmem_depot_drain(cache);
+	kmem_cache_release_slabs(cache);
+}
+
+
 struct kmem_border_tag {
 	struct kmem_border_tag *next;
 };
@@ -171,9 +432,18 @@ struct kmem_small_slab {
 	struct kmem_border_tag *free_list;
 };
 
+/*
+ * Slabs of a cache created with KMEM_COLOR start their objects at
+ * different offsets (colors), so that objects at the same index in
+ * different slabs don't compete for the same cache sets. Colors are
+ * taken from the space left unused at the end of the slab anyway.
+ */
 struct kmem_small_cache {
 	struct kmem_cache common;
 	size_t padded_size;
+	size_t color_step;
+	size_t color_max;
+	size_t color; // protected by common.lock
 };
 
 
@@ -224,8 +494,13 @@ static struct kmem_slab *kmem_small_slab_create(struct kmem_cache *cache,
 	slab->free_list = 0;
 
 	const size_t sz = small->padded_size;
+	const size_t color = small->color;
+
+	small->color += small->color_step;
+	if (small->color > small->color_max)
+		small->color = 0;
 
-	for (char *ptr = vaddr; ptr + sz <= (char *)slab; ptr += sz) {
+	for (char *ptr = vaddr + color; ptr + sz <= (char *)slab; ptr += sz) {
 		kmem_small_slab_free(cache, &slab->common, ptr);
 		++slab->common.total;
 		++slab->common.free;
@@ -239,9 +514,10 @@ static const struct kmem_cache_ops small_cache_ops = {
 };
 
 static struct kmem_small_cache kmem_small_cache_cache;
+static struct kmem_small_cache kmem_magazine_small_cache;
 
 static void kmem_small_cache_init(struct kmem_small_cache *cache,
-			size_t size, size_t align)
+			size_t size, size_t align, unsigned long flags)
 {
 	const size_t sz = sizeof(struct kmem_border_tag);
 	const size_t al = ALIGN_OF(struct kmem_border_tag);
@@ -255,10 +531,21 @@ static void kmem_small_cache_init(struct kmem_small_cache *cache,
 
 	cache->padded_size = ALIGN(size + sz, align);
 
-	kmem_cache_init(&cache->common);
+	const size_t space = PAGE_SIZE - sizeof(struct kmem_small_slab);
+	const size_t objects = space / cache->padded_size;
+
+	cache->color_step = ALIGN(KMEM_CACHE_LINE, align);
+	cache->color_max = 0;
+	cache->color = 0;
+
+	if (flags & KMEM_COLOR)
+		cache->color_max = space - objects * cache->padded_size;
+
+	kmem_cache_init(&cache->common, objects, flags);
 }
 
-static struct kmem_cache *kmem_small_cache_create(size_t size, size_t align)
+static struct kmem_cache *kmem_small_cache_create(size_t size, size_t align,
+			unsigned long flags)
 {
 	struct kmem_small_cache *cache =
 		kmem_cache_alloc((struct kmem_cache *)&kmem_small_cache_cache);
@@ -266,7 +553,7 @@ static struct kmem_cache *kmem_small_cache_create(size_t size, size_t align)
 	if (!cache)
 		return 0;
 
-	kmem_small_cache_init(cache, size, align);
+	kmem_small_cache_init(cache, size, align, flags);
 
 	return (struct kmem_cache *)cache;
 }
@@ -275,57 +562,52 @@ static void kmem_small_cache_setup(void)
 {
 	kmem_small_cache_init(&kmem_small_cache_cache,
 		sizeof(struct kmem_small_cache),
-		ALIGN_OF(struct kmem_small_cache));
+		ALIGN_OF(struct kmem_small_cache), KMEM_NOMAGAZINE);
+
+	kmem_small_cache_init(&kmem_magazine_small_cache,
+		sizeof(struct kmem_magazine),
+		ALIGN_OF(struct kmem_magazine), KMEM_NOMAGAZINE);
+
+	kmem_magazine_cache = (struct kmem_cache *)&kmem_magazine_small_cache;
 }
 
 
-struct kmem_tag {
-	struct kmem_tag *next;
-	void *ptr;
-};
+/*
+ * Large slabs keep the slab descriptor off-slab, and instead of a tag
+ * per object the descriptor holds a bitmap of free objects, so an
+ * object index is all we need both to allocate and to free.
+ */
+#define KMEM_LARGE_OBJECTS (sizeof(unsigned long) * 8)
 
 struct kmem_large_slab {
 	struct kmem_slab common;
-	struct kmem_tag *free;
-	struct kmem_tag *busy;
+	char *vaddr;
+	unsigned long free_mask;
 };
 
 struct kmem_large_cache {
 	struct kmem_cache common;
 	struct kmem_cache *slab_cache;
-	struct kmem_cache *tag_cache;
 };
 
 
 static void *kmem_large_slab_alloc(struct kmem_cache *c, struct kmem_slab *s)
 {
 	struct kmem_large_slab *slab = (struct kmem_large_slab *)s;
+	const int index = __builtin_ctzl(slab->free_mask);
 
-	(void) c;
-
-	struct kmem_tag *tag = slab->free;
-	void *ptr = tag->ptr;
+	slab->free_mask &= slab->free_mask - 1;
 
-	slab->free = tag->next;
-	tag->next = slab->busy;
-	slab->busy = tag;
-
-	return ptr;
+	return slab->vaddr + index * c->object_size;
 }
 
 static void kmem_large_slab_free(struct kmem_cache *c, struct kmem_slab *s,
 			void *ptr)
 {
 	struct kmem_large_slab *slab = (struct kmem_large_slab *)s;
+	const size_t index = ((char *)ptr - slab->vaddr) / c->object_size;
 
-	(void) c;
-
-	struct kmem_tag *tag = slab->busy;
-
-	slab->busy = tag->next;
-	tag->next = slab->free;
-	tag->ptr = ptr;
-	slab->free = tag;
+	slab->free_mask |= 1ul << index;
 }
 
 static const struct kmem_slab_ops large_slab_ops = {
@@ -333,16 +615,11 @@ static const struct kmem_slab_ops large_slab_ops = {
 	.free = kmem_large_slab_free
 };
 
-static void kmem_large_slab_release(struct kmem_large_cache *cache,
-			struct kmem_large_slab *slab)
-{	
-	while (slab->free) {
-		struct kmem_tag *tag = slab->free;
+static size_t kmem_large_slab_objects(const struct kmem_cache *cache)
+{
+	const size_t bytes = (size_t)PAGE_SIZE << cache->order;
 
-		slab->free = tag->next;
-		kmem_cache_free(cache->tag_cache, tag);
-	}
-	kmem_cache_free(cache->slab_cache, slab);
+	return MINU(bytes / cache->object_size, KMEM_LARGE_OBJECTS);
 }
 
 static struct kmem_slab *kmem_large_slab_create(struct kmem_cache *c,
@@ -354,26 +631,14 @@ static struct kmem_slab *kmem_large_slab_create(struct kmem_cache *c,
 	if (!slab)
 		return 0;
 
-	const pfn_t pfs = (pfn_t)1 << c->order;
-	const size_t count = (pfs << PAGE_BITS) / c->object_size;
-	char *ptr = va(page2pfn(page) << PAGE_BITS);
+	const size_t count = kmem_large_slab_objects(c);
 
 	slab->common.ops = &large_slab_ops;
 	slab->common.total = count;
 	slab->common.free = count;
-
-	for (size_t i = 0; i != count; ++i, ptr += c->object_size) {
-		struct kmem_tag *tag = kmem_cache_alloc(cache->tag_cache);
-
-		if (!tag) {
-			kmem_large_slab_release(cache, slab);
-			return 0;
-		}
-
-		tag->next = slab->free;
-		tag->ptr = ptr;
-		slab->free = tag;
-	}
+	slab->vaddr = va(page2pfn(page) << PAGE_BITS);
+	slab->free_mask = (count == KMEM_LARGE_OBJECTS)
+				? ~0ul : (1ul << count) - 1;
 
 	return (struct kmem_slab *)slab;
 }
@@ -381,9 +646,8 @@ static struct kmem_slab *kmem_large_slab_create(struct kmem_cache *c,
 static void kmem_large_slab_destroy(struct kmem_cache *c, struct kmem_slab *s)
 {
 	struct kmem_large_cache *cache = (struct kmem_large_cache *)c;
-	struct kmem_large_slab *slab = (struct kmem_large_slab *)s;
 
-	kmem_large_slab_release(cache, slab);
+	kmem_cache_free(cache->slab_cache, s);
 }
 
 static const struct kmem_cache_ops large_cache_ops = {
@@ -393,10 +657,9 @@ static const struct kmem_cache_ops large_cache_ops = {
 
 static struct kmem_small_cache kmem_large_cache_cache;
 static struct kmem_small_cache kmem_large_slab_cache;
-static struct kmem_small_cache kmem_large_tag_cache;
 
 static void kmem_large_cache_init(struct kmem_large_cache *cache,
-			size_t size, size_t align)
+			size_t size, size_t align, unsigned long flags)
 {
 	const size_t object_size = ALIGN(size, align);
 
@@ -414,12 +677,13 @@ static void kmem_large_cache_init(struct kmem_large_cache *cache,
 	cache->common.ops = &large_cache_ops;
 
 	cache->slab_cache = (struct kmem_cache *)&kmem_large_slab_cache;
-	cache->tag_cache = (struct kmem_cache *)&kmem_large_tag_cache;
 
-	kmem_cache_init(&cache->common);
+	kmem_cache_init(&cache->common,
+		kmem_large_slab_objects(&cache->common), flags);
 }
 
-static struct kmem_cache *kmem_large_cache_create(size_t size, size_t align)
+static struct kmem_cache *kmem_large_cache_create(size_t size, size_t align,
+			unsigned long flags)
 {
 	struct kmem_large_cache *cache =
 		kmem_cache_alloc((struct kmem_cache *)&kmem_large_cache_cache);
@@ -427,7 +691,7 @@ static struct kmem_cache *kmem_large_cache_create(size_t size, size_t align)
 	if (!cache)
 		return 0;
 
-	kmem_large_cache_init(cache, size, align);
+	kmem_large_cache_init(cache, size, align, flags);
 
 	return (struct kmem_cache *)cache;
 }
@@ -436,26 +700,23 @@ static void kmem_large_cache_setup(void)
 {
 	kmem_small_cache_init(&kmem_large_cache_cache,
 		sizeof(struct kmem_large_cache),
-		ALIGN_OF(struct kmem_large_cache));
+		ALIGN_OF(struct kmem_large_cache), KMEM_NOMAGAZINE);
 
 	kmem_small_cache_init(&kmem_large_slab_cache,
 		sizeof(struct kmem_large_slab),
-		ALIGN_OF(struct kmem_large_slab));
-
-	kmem_small_cache_init(&kmem_large_tag_cache,
-		sizeof(struct kmem_tag),
-		ALIGN_OF(struct kmem_tag));
+		ALIGN_OF(struct kmem_large_slab), KMEM_NOMAGAZINE);
 }
 
 
-struct kmem_cache *kmem_cache_create(size_t size, size_t align)
+struct kmem_cache *kmem_cache_create(size_t size, size_t align,
+			unsigned long flags)
 {
 	struct kmem_cache *cache;
 
 	if (size <= PAGE_SIZE / 8)
-		cache = kmem_small_cache_create(size, align);
+		cache = kmem_small_cache_create(size, align, flags);
 	else
-		cache = kmem_large_cache_create(size, align);
+		cache = kmem_large_cache_create(size, align, flags);
 
 	if (!cache)
 		return 0;
@@ -466,6 +727,7 @@ struct kmem_cache *kmem_cache_create(size_t size, size_t align)
 
 void kmem_cache_destroy(struct kmem_cache *cache)
 {
+	kmem_cpu_cache_drain(cache);
 	kmem_cache_reap(cache);
 
 	if (!list_empty(&cache->part_list))
@@ -478,23 +740,79 @@ void kmem_cache_destroy(struct kmem_cache *cache)
 }
 
 
-static const size_t kmem_size[] = {
-	8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120, 128,
-	256, 384, 512, 640, 768, 1024, 1280, 1536, 1792, 2048, 3072, 4096,
-	8 * 1024, 16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024, 256 * 1024
-};
+#define KMEM_SIZES(X, arg) \
+	X(8, arg) X(16, arg) X(24, arg) X(32, arg) X(40, arg) X(48, arg) \
+	X(56, arg) X(64, arg) X(72, arg) X(80, arg) X(88, arg) X(96, arg) \
+	X(104, arg) X(112, arg) X(120, arg) X(128, arg) X(256, arg) \
+	X(384, arg) X(512, arg) X(640, arg) X(768, arg) X(1024, arg) \
+	X(1280, arg) X(1536, arg) X(1792, arg) X(2048, arg) X(3072, arg) \
+	X(4096, arg) X(8 * 1024, arg) X(16 * 1024, arg) X(32 * 1024, arg) \
+	X(64 * 1024, arg) X(128 * 1024, arg) X(256 * 1024, arg)
+
+#define KMEM_SIZE(size, unused) size,
+
+static const size_t kmem_size[] = { KMEM_SIZES(KMEM_SIZE, 0) };
 
 #define KMEM_POOLS (sizeof(kmem_size)/sizeof(kmem_size[0]))
 static struct kmem_cache *kmem_pool[KMEM_POOLS];
 
 
+/*
+ * Index of the first class that fits size is just the number of
+ * classes smaller than size. It's a constant expression, so we use it
+ * to build the lookup table at compile time from the KMEM_SIZES list.
+ */
+#define KMEM_LESS(size, arg) ((size) < (arg)) +
+#define KMEM_INDEX(size) (KMEM_SIZES(KMEM_LESS, (size)) 0)
+
+/*
+ * Up to KMEM_LOOKUP_MAX classes go in KMEM_LOOKUP_STEP increments, so
+ * lookup table gives index with one load. Above that all classes are
+ * powers of two, so ilog2 is enough.
+ */
+#define KMEM_LOOKUP_STEP  8
+#define KMEM_LOOKUP_MAX   4096
+#define KMEM_LOOKUP_BASE  KMEM_INDEX(KMEM_LOOKUP_MAX)
+#define KMEM_LOOKUP_BITS  12
+
+#define KMEM_LOOKUP1(i)   KMEM_INDEX((i) * KMEM_LOOKUP_STEP),
+#define KMEM_LOOKUP8(i)   KMEM_LOOKUP1(i) KMEM_LOOKUP1((i) + 1) \
+			KMEM_LOOKUP1((i) + 2) KMEM_LOOKUP1((i) + 3) \
+			KMEM_LOOKUP1((i) + 4) KMEM_LOOKUP1((i) + 5) \
+			KMEM_LOOKUP1((i) + 6) KMEM_LOOKUP1((i) + 7)
+#define KMEM_LOOKUP64(i)  KMEM_LOOKUP8(i) KMEM_LOOKUP8((i) + 8) \
+			KMEM_LOOKUP8((i) + 16) KMEM_LOOKUP8((i) + 24) \
+			KMEM_LOOKUP8((i) + 32) KMEM_LOOKUP8((i) + 40) \
+			KMEM_LOOKUP8((i) + 48) KMEM_LOOKUP8((i) + 56)
+#define KMEM_LOOKUP512(i) KMEM_LOOKUP64(i) KMEM_LOOKUP64((i) + 64) \
+			KMEM_LOOKUP64((i) + 128) KMEM_LOOKUP64((i) + 192) \
+			KMEM_LOOKUP64((i) + 256) KMEM_LOOKUP64((i) + 320) \
+			KMEM_LOOKUP64((i) + 384) KMEM_LOOKUP64((i) + 448)
+
+static const unsigned char kmem_lookup[] = {
+	KMEM_LOOKUP1(0) KMEM_LOOKUP512(1)
+};
+
+
+int kmem_pools(void)
+{ return KMEM_POOLS; }
+
+size_t kmem_pool_size(int pool)
+{ return kmem_size[pool]; }
+
 static int kmem_cache_index(size_t size)
 {
-	for (int i = 0; i != KMEM_POOLS; ++i) {
-		if (size <= kmem_size[i])
-			return i;
+	if (size <= KMEM_LOOKUP_MAX) {
+		const size_t i = (size + KMEM_LOOKUP_STEP - 1) /
+					KMEM_LOOKUP_STEP;
+
+		return kmem_lookup[i];
 	}
-	return -1;
+
+	if (size > kmem_size[KMEM_POOLS - 1])
+		return -1;
+
+	return KMEM_LOOKUP_BASE + ilog2(size - 1) + 1 - KMEM_LOOKUP_BITS;
 }
 
 void *kmem_alloc(size_t size)
@@ -526,7 +844,14 @@ void setup_alloc(void)
 	kmem_large_cache_setup();
 
 	for (int i = 0; i != KMEM_POOLS; ++i) {
-		kmem_pool[i] = kmem_cache_create(kmem_size[i], sizeof(void *));
+		DBG_ASSERT(kmem_cache_index(kmem_size[i]) == i);
+		DBG_ASSERT(kmem_cache_index(kmem_size[i] + 1) == i + 1 ||
+			i == KMEM_POOLS - 1);
+	}
+
+	for (int i = 0; i != KMEM_POOLS; ++i) {
+		kmem_pool[i] = kmem_cache_create(kmem_size[i], sizeof(void *),
+					0);
 		DBG_ASSERT(kmem_pool[i] != 0);
 	}
 }
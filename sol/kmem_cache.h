@@ -3,9 +3,15 @@
 
 #include "kernel.h"
 
+/* don't put per-cpu magazine layer in front of the cache */
+#define KMEM_NOMAGAZINE BIT_CONST(0)
+/* rotate object offset across slabs to spread them over cache sets */
+#define KMEM_COLOR      BIT_CONST(1)
+
 struct kmem_cache;
 
-struct kmem_cache *kmem_cache_create(size_t size, size_t align);
+struct kmem_cache *kmem_cache_create(size_t size, size_t align,
+			unsigned long flags);
 void kmem_cache_destroy(struct kmem_cache *cache);
 void *kmem_cache_alloc(struct kmem_cache *cache);
 void kmem_cache_free(struct kmem_cache *cache, void *ptr);
@@ -14,9 +20,12 @@ void kmem_cache_reap(struct kmem_cache *cache);
 void *kmem_alloc(size_t size);
 void kmem_free(void *ptr);
 
+int kmem_pools(void);
+size_t kmem_pool_size(int pool);
+
 void setup_alloc(void);
 
 #define KMEM_CACHE(type) \
-	kmem_cache_create(sizeof(type), ALIGN_OF(type))
+	kmem_cache_create(sizeof(type), ALIGN_OF(type), 0)
 
 #endif /*__KMEM_CACHE_H__*/
@@ -62,6 +62,100 @@ void mutex_unlock(struct mutex *mutex)
 	spin_unlock_irqrestore(&mutex->wq.lock, enabled);
 }
 
+struct rwsem_waiter {
+	struct wait_head wh;
+	bool granted;
+};
+
+/* called with sem->lock held, returns with it released */
+static void __rwsem_wait(struct rwsem *sem, struct list_head *queue)
+{
+	struct rwsem_waiter waiter;
+
+	waiter.wh.thread = current();
+	waiter.granted = false;
+	list_add_tail(&waiter.wh.link, queue);
+
+	while (!waiter.granted) {
+		waiter.wh.thread->state = THREAD_BLOCKED;
+		spin_unlock(&sem->lock);
+		schedule();
+		spin_lock(&sem->lock);
+	}
+	spin_unlock(&sem->lock);
+}
+
+static void __rwsem_grant(struct list_head *queue)
+{
+	struct list_head *ptr = list_first(queue);
+	struct rwsem_waiter *waiter = LIST_ENTRY(ptr, struct rwsem_waiter,
+				wh.link);
+
+	list_del(ptr);
+	waiter->granted = true;
+	activate_thread(waiter->wh.thread);
+}
+
+static void __rwsem_wake(struct rwsem *sem)
+{
+	if (!list_empty(&sem->writers)) {
+		sem->count = -1;
+		__rwsem_grant(&sem->writers);
+		return;
+	}
+
+	while (!list_empty(&sem->readers)) {
+		++sem->count;
+		__rwsem_grant(&sem->readers);
+	}
+}
+
+void rwsem_read_lock(struct rwsem *sem)
+{
+	DBG_ASSERT(local_preempt_enabled());
+	spin_lock(&sem->lock);
+
+	if (sem->count >= 0 && list_empty(&sem->writers)) {
+		++sem->count;
+		spin_unlock(&sem->lock);
+		return;
+	}
+	__rwsem_wait(sem, &sem->readers);
+}
+
+void rwsem_read_unlock(struct rwsem *sem)
+{
+	const bool enabled = spin_lock_irqsave(&sem->lock);
+
+	DBG_ASSERT(sem->count > 0);
+	if (!--sem->count)
+		__rwsem_wake(sem);
+	spin_unlock_irqrestore(&sem->lock, enabled);
+}
+
+void rwsem_write_lock(struct rwsem *sem)
+{
+	DBG_ASSERT(local_preempt_enabled());
+	spin_lock(&sem->lock);
+
+	if (!sem->count) {
+		sem->count = -1;
+		spin_unlock(&sem->lock);
+		return;
+	}
+	__rwsem_wait(sem, &sem->writers);
+}
+
+void rwsem_write_unlock(struct rwsem *sem)
+{
+	const bool enabled = spin_lock_irqsave(&sem->lock);
+
+	DBG_ASSERT(sem->count == -1);
+	sem->count = 0;
+	__rwsem_wake(sem);
+	spin_unlock_irqrestore(&sem->lock, enabled);
+}
+
 void condition_wait(struct mutex *mutex, struct condition *condition)
 {
 	struct thread *self = current();
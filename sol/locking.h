@@ -114,6 +114,41 @@ void mutex_lock(struct mutex *mutex);
 void mutex_unlock(struct mutex *mutex);
 
 
+/**
+ * Reader-writer semaphore. Writers are preferred: once a writer waits
+ * new readers queue behind it. Release hands the semaphore over to
+ * the waiters directly, either to the first writer or to all waiting
+ * readers at once, so woken threads don't have to compete for it.
+ */
+struct rwsem {
+	struct spinlock lock;
+	struct list_head readers;
+	struct list_head writers;
+	int count; // number of readers holding it, -1 if a writer holds it
+};
+
+#define RWSEM_INIT(name) {			\
+	SPINLOCK_INIT((name).lock),		\
+	LIST_HEAD_INIT((name).readers),		\
+	LIST_HEAD_INIT((name).writers),		\
+	0					\
+}
+#define DEFINE_RWSEM(name) struct rwsem name = RWSEM_INIT(name)
+
+static inline void rwsem_init(struct rwsem *sem)
+{
+	spinlock_init(&sem->lock);
+	list_init(&sem->readers);
+	list_init(&sem->writers);
+	sem->count = 0;
+}
+
+void rwsem_read_lock(struct rwsem *sem);
+void rwsem_read_unlock(struct rwsem *sem);
+void rwsem_write_lock(struct rwsem *sem);
+void rwsem_write_unlock(struct rwsem *sem);
+
+
 struct condition {
 	struct wait_queue wq;
 };
@@ -4,8 +4,11 @@
 #include "threads.h"
 #include "memory.h"
 #include "serial.h"
+#include "string.h"
 #include "paging.h"
+#include "mm.h"
 #include "stdio.h"
+#include "error.h"
 #include "ramfs.h"
 #include "misc.h"
 #include "time.h"
@@ -65,6 +68,182 @@ static void buddy_smoke_test(void)
 	DBG_INFO("Buddy test finished");
 }
 
+static void mempolicy_smoke_test(void)
+{
+	DBG_INFO("Start mempolicy test");
+	const int nodes = memory_nodes_count();
+	struct page *page[16];
+	struct nodemask mask;
+
+	DBG_INFO("%d memory nodes", nodes);
+	DBG_ASSERT(set_mempolicy(MPOL_PREFERRED, nodes, 0) == -EINVAL);
+	DBG_ASSERT(set_mempolicy(MPOL_BIND, 0, 0) == -EINVAL);
+
+	for (int node = 0; node != nodes; ++node) {
+		nodemask_clear(&mask);
+		nodemask_set(&mask, node);
+		DBG_ASSERT(set_mempolicy(MPOL_BIND, 0, &mask) == 0);
+
+		for (int i = 0; i != ARRAY_SIZE(page); ++i) {
+			page[i] = alloc_pages(0);
+			DBG_ASSERT(!page[i] || page_node_id(page[i]) == node);
+		}
+
+		for (int i = 0; i != ARRAY_SIZE(page); ++i)
+			free_pages(page[i], 0);
+	}
+
+	nodemask_clear(&mask);
+	for (int node = 0; node != nodes; ++node)
+		nodemask_set(&mask, node);
+	DBG_ASSERT(set_mempolicy(MPOL_INTERLEAVE, 0, &mask) == 0);
+
+	for (int i = 0; i != ARRAY_SIZE(page); ++i) {
+		page[i] = alloc_pages(0);
+		if (page[i])
+			DBG_INFO("interleave page %d from node %d",
+				i, page_node_id(page[i]));
+	}
+
+	for (int i = 0; i != ARRAY_SIZE(page); ++i)
+		free_pages(page[i], 0);
+
+	DBG_ASSERT(set_mempolicy(MPOL_LOCAL, 0, 0) == 0);
+	dump_buddy_state();
+	DBG_INFO("Mempolicy test finished");
+}
+
+static void kmap_smoke_test(void)
+{
+	DBG_INFO("Start kmap test");
+	struct page *page[2];
+
+	page[0] = alloc_pages(0);
+	page[1] = alloc_pages(0);
+	DBG_ASSERT(page[0] && page[1]);
+
+	char *ptr = kmap(page, ARRAY_SIZE(page));
+
+	DBG_ASSERT(ptr != 0);
+	ptr[0] = 'a';
+	ptr[PAGE_SIZE] = 'b';
+	kunmap(ptr);
+
+	char *src = kmap_atomic(page[0]);
+	char *dst = kmap_atomic(page[1]);
+
+	DBG_ASSERT(src[0] == 'a' && dst[0] == 'b');
+	dst[0] = src[0];
+	kunmap_atomic(dst);
+	kunmap_atomic(src);
+	DBG_ASSERT(*(char *)page_addr(page[1]) == 'a');
+
+	free_pages(page[0], 0);
+	free_pages(page[1], 0);
+	DBG_INFO("kmap test finished");
+}
+
+static void huge_page_smoke_test(void)
+{
+	DBG_INFO("Start huge page test");
+	const size_t pages = 3 * PML1_PAGES + 7;
+	char *ptr = kmap_alloc(pages);
+
+	DBG_ASSERT(ptr != 0);
+	for (size_t i = 0; i != pages; ++i)
+		ptr[i << PAGE_BITS] = (char)i;
+	for (size_t i = 0; i != pages; ++i)
+		DBG_ASSERT(ptr[i << PAGE_BITS] == (char)i);
+	kmap_free(ptr);
+
+	struct mm *mm = create_mm();
+
+	DBG_ASSERT(mm != 0);
+	DBG_ASSERT(mm_alloc_range(mm, PAGE_SIZE,
+				2 * HUGE_PAGE_SIZE + PAGE_SIZE) == 0);
+	mm_free_range(mm, PAGE_SIZE, HUGE_PAGE_SIZE);
+	release_mm(mm);
+
+	unsigned long invlpg, full, avoided;
+
+	tlb_stats(&invlpg, &full, &avoided);
+	DBG_INFO("tlb: %lu invlpg, %lu full flushes, %lu avoided",
+		invlpg, full, avoided);
+	DBG_INFO("Huge page test finished");
+}
+
+static void cow_smoke_test(void)
+{
+	DBG_INFO("Start copy-on-write test");
+	const virt_t addr = HUGE_PAGE_SIZE;
+	struct mm *parent = create_mm();
+
+	DBG_ASSERT(parent != 0);
+	DBG_ASSERT(mm_alloc_range(parent, addr, addr + PAGE_SIZE) == 0);
+
+	struct pt_iter iter;
+	struct pt_iter child_iter;
+
+	pt_iter_set(&iter, page_addr(parent->pt), addr);
+	*(int *)va(pte_phys(iter.pt[0][iter.idx[0]])) = 42;
+
+	struct mm *child = clone_mm(parent);
+
+	DBG_ASSERT(child != 0);
+	pt_iter_set(&child_iter, page_addr(child->pt), addr);
+
+	const pte_t pte = iter.pt[0][iter.idx[0]];
+
+	DBG_ASSERT(pte == child_iter.pt[0][child_iter.idx[0]]);
+	DBG_ASSERT(pte_cow(pte) && !pte_write(pte));
+
+	/* the child gets a copy, the parent keeps the page */
+	DBG_ASSERT(mm_page_fault(child, addr, PF_PRESENT | PF_WRITE) == 0);
+	DBG_ASSERT(mm_page_fault(parent, addr, PF_PRESENT | PF_WRITE) == 0);
+
+	const pte_t parent_pte = iter.pt[0][iter.idx[0]];
+	const pte_t child_pte = child_iter.pt[0][child_iter.idx[0]];
+
+	DBG_ASSERT(pte_phys(parent_pte) == pte_phys(pte));
+	DBG_ASSERT(pte_phys(child_pte) != pte_phys(pte));
+	DBG_ASSERT(pte_write(parent_pte) && pte_write(child_pte));
+	DBG_ASSERT(*(int *)va(pte_phys(child_pte)) == 42);
+	DBG_ASSERT(mm_page_fault(child, addr, PF_PRESENT | PF_WRITE) != 0);
+
+	release_mm(child);
+	release_mm(parent);
+	DBG_INFO("Copy-on-write test finished");
+}
+
+static void demand_paging_smoke_test(void)
+{
+	DBG_INFO("Start demand paging test");
+	const virt_t addr = HUGE_PAGE_SIZE;
+	struct mm *mm = create_mm();
+	struct pt_iter iter;
+
+	DBG_ASSERT(mm != 0);
+	DBG_ASSERT(mm_map(mm, addr, addr + 4 * PAGE_SIZE, 0, 0) == 0);
+	DBG_ASSERT(mm_map(mm, addr + PAGE_SIZE, addr + 2 * PAGE_SIZE, 0, 0)
+				== -EBUSY);
+
+	pt_iter_set(&iter, page_addr(mm->pt), addr + PAGE_SIZE);
+	DBG_ASSERT(iter.level == 0 && !pt_iter_present(&iter));
+	DBG_ASSERT(mm_page_fault(mm, addr + PAGE_SIZE, PF_WRITE) == 0);
+	DBG_ASSERT(pt_iter_present(&iter));
+	DBG_ASSERT(*(int *)va(pte_phys(iter.pt[0][iter.idx[0]])) == 0);
+	DBG_ASSERT(mm_page_fault(mm, addr + 4 * PAGE_SIZE, PF_WRITE)
+				== -EFAULT);
+
+	/* splits the vma in two */
+	DBG_ASSERT(mm_unmap(mm, addr + PAGE_SIZE, addr + 2 * PAGE_SIZE) == 0);
+	DBG_ASSERT(mm_page_fault(mm, addr + PAGE_SIZE, PF_WRITE) == -EFAULT);
+	DBG_ASSERT(mm_page_fault(mm, addr + 3 * PAGE_SIZE, PF_WRITE) == 0);
+
+	release_mm(mm);
+	DBG_INFO("Demand paging test finished");
+}
+
 struct intlist {
 	struct list_head link;
 	int data;
@@ -100,6 +279,48 @@ static void slab_smoke_test(void)
 	DBG_INFO("SLAB test finished");
 }
 
+#define RWSEM_TEST_READERS 4
+
+static DEFINE_RWSEM(test_rwsem);
+static int rwsem_readers;
+static int rwsem_max_readers;
+
+static int rwsem_reader(void *dummy)
+{
+	(void) dummy;
+
+	rwsem_read_lock(&test_rwsem);
+	rwsem_max_readers = MAX(rwsem_max_readers, ++rwsem_readers);
+	schedule();
+	--rwsem_readers;
+	rwsem_read_unlock(&test_rwsem);
+	return 0;
+}
+
+/* readers queued behind a writer must all get in together */
+static void rwsem_smoke_test(void)
+{
+	pid_t pid[RWSEM_TEST_READERS];
+
+	DBG_INFO("Start rwsem test");
+	rwsem_write_lock(&test_rwsem);
+	for (int i = 0; i != RWSEM_TEST_READERS; ++i) {
+		pid[i] = create_kthread(&rwsem_reader, 0);
+		DBG_ASSERT(pid[i] >= 0);
+	}
+	schedule();
+	rwsem_write_unlock(&test_rwsem);
+
+	for (int i = 0; i != RWSEM_TEST_READERS; ++i)
+		wait(pid[i]);
+
+	if (rwsem_max_readers != RWSEM_TEST_READERS)
+		DBG_ERR("only %d readers held rwsem at once",
+			rwsem_max_readers);
+	else
+		DBG_INFO("rwsem test finished");
+}
+
 static int test_function(void *dummy)
 {
 	(void) dummy;
@@ -126,14 +347,41 @@ static int start_kernel(void *dummy)
 	setup_initramfs();
 
 	buddy_smoke_test();
+	mempolicy_smoke_test();
+	kmap_smoke_test();
+	huge_page_smoke_test();
+	cow_smoke_test();
+	demand_paging_smoke_test();
 	slab_smoke_test();
 	test_threading();
+	rwsem_smoke_test();
+
+#ifdef CONFIG_KMEM_BENCH
+	void kmem_bench(void);
+	void kmem_color_bench(void);
+
+	kmem_bench();
+	kmem_color_bench();
+#endif /* CONFIG_KMEM_BENCH */
+
+#ifdef CONFIG_BUDDY_BENCH
+	void buddy_bench(void);
+
+	buddy_bench();
+#endif /* CONFIG_BUDDY_BENCH */
+
+#ifdef CONFIG_VFS_BENCH
+	void vfs_bench(void);
+
+	vfs_bench();
+#endif /* CONFIG_VFS_BENCH */
 
 	return 0;
 }
 
 void main(void)
 {
+	setup_string();
 	setup_serial();
 	setup_misc();
 	setup_ints();
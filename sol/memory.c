@@ -4,26 +4,43 @@
 #include "kernel.h"
 #include "memory.h"
 #include "balloc.h"
+#include "string.h"
 #include "stdio.h"
+#include "threads.h"
+#include "error.h"
 #include "misc.h"
+#include "cpu.h"
 
-#define MAX_MEMORY_NODES (1 << PAGE_NODE_BITS)
+#define LAZY_BUDDY_SHIFT 6 // up to 1/64 of node may stay unmerged
+#define ZERO_POOL_SHIFT  8 // up to 1/256 of node may stay in zero pool
+#define ZERO_POOL_HIGH   256
+#define ZERO_POOL_BATCH  16
+#define SHRINK_BATCH     128 // objects asked from every shrinker at once
 
 static struct memory_node nodes[MAX_MEMORY_NODES];
 static int memory_nodes;
 static LIST_HEAD(node_order);
+static LIST_HEAD(shrinkers);
+static DEFINE_SPINLOCK(shrinkers_lock);
+static bool shrinking;
 static struct list_head *node_type[NT_COUNT];
 
 
 struct memory_node *memory_node_get(int id)
 { return &nodes[id]; }
 
+int memory_nodes_count(void)
+{ return memory_nodes; }
+
 static pfn_t node_pfn(const struct memory_node *node, const struct page *page)
 { return page - node->mmap; }
 
 static struct page *node_page(const struct memory_node *node, pfn_t pfn)
 { return &node->mmap[pfn]; }
 
+static void buddy_free_pages_node(struct page *pages, int order,
+			struct memory_node *node);
+
 static int pfn_max_order(pfn_t pfn)
 {
 	for (int i = 0; i != BUDDY_ORDERS - 1; ++i)
@@ -58,8 +75,34 @@ static void __memory_node_add(enum node_type type, unsigned long begin,
 	node->end_pfn = pfn + pages;
 	node->id = memory_nodes++;
 	node->type = type;
-	for (int i = 0; i != BUDDY_ORDERS; ++i)
+	for (int i = 0; i != BUDDY_ORDERS; ++i) {
 		list_init(&node->free_list[i]);
+		node->free_count[i] = 0;
+	}
+	node->free_mask = 0;
+
+	node->lazy = false;
+	for (int i = 0; i != BUDDY_ORDERS; ++i)
+		list_init(&node->lazy_list[i]);
+	node->lazy_pages = 0;
+	node->lazy_high = pages >> LAZY_BUDDY_SHIFT;
+	memset(&node->stats, 0, sizeof(node->stats));
+	list_init(&node->zero_list);
+	node->zero_count = 0;
+	node->zero_high = MINU(pages >> ZERO_POOL_SHIFT, ZERO_POOL_HIGH);
+	node->zero_hits = 0;
+	node->zero_misses = 0;
+	node->numa_hit = 0;
+	node->numa_miss = 0;
+	node->numa_foreign = 0;
+
+	for (int i = 0; i != NR_CPUS; ++i) {
+		struct per_cpu_pages *pcp = &node->pcp[i];
+
+		memset(pcp, 0, sizeof(*pcp));
+		for (int j = 0; j != PCP_ORDERS; ++j)
+			list_init(&pcp->list[j]);
+	}
 
 	const long long mmap = balloc_alloc_aligned(PAGE_SIZE, LOWMEM_SIZE,
 				sizeof(struct page) * pages, PAGE_SIZE);
@@ -78,6 +121,26 @@ static void __memory_node_add(enum node_type type, unsigned long begin,
 		node->begin_pfn, node->end_pfn - 1);
 }
 
+/**
+ * CONFIG_MEMORY_NODE_SIZE splits memory into nodes of the given size,
+ * so node policies can be exercised on a machine with a flat memory.
+ */
+static void memory_node_split(enum node_type type, unsigned long begin,
+			unsigned long end)
+{
+#ifdef CONFIG_MEMORY_NODE_SIZE
+	const unsigned long size = CONFIG_MEMORY_NODE_SIZE;
+
+	while (end - begin > size && memory_nodes < MAX_MEMORY_NODES - 1) {
+		const unsigned long next = ALIGN(begin + 1, size);
+
+		__memory_node_add(type, begin, next);
+		begin = next;
+	}
+#endif
+	__memory_node_add(type, begin, end);
+}
+
 static void memory_node_add(unsigned long long addr, unsigned long long size)
 {
 	const unsigned long long begin = ALIGN(addr, PAGE_SIZE);
@@ -88,47 +151,56 @@ static void memory_node_add(unsigned long long addr, unsigned long long size)
 		return;
 
 	if (begin < LOWMEM_SIZE && end > LOWMEM_SIZE) {
-		__memory_node_add(NT_LOW, begin, LOWMEM_SIZE);
-		__memory_node_add(NT_HIGH, LOWMEM_SIZE, end);
+		memory_node_split(NT_LOW, begin, LOWMEM_SIZE);
+		memory_node_split(NT_HIGH, LOWMEM_SIZE, end);
 	} else {
 		const enum node_type type = (end <= LOWMEM_SIZE)
 					? NT_LOW : NT_HIGH;
 
-		__memory_node_add(type, begin, end);
+		memory_node_split(type, begin, end);
 	}
 }
 
-static void __memory_free_region(unsigned long long begin,
-			unsigned long long end)
+static void __memory_free_node_region(struct memory_node *node,
+			pfn_t begin, pfn_t end)
 {
-	const pfn_t b = begin >> PAGE_BITS;
-	const pfn_t e = end >> PAGE_BITS;
-	const pfn_t pages = e - b;
-
-	struct memory_node *node = pfn_node(b);
-
-	const pfn_t node_pfn = b - node->begin_pfn;
-
-	for (pfn_t pfn = node_pfn; pfn != node_pfn + pages;) {
+	for (pfn_t pfn = begin; pfn != end;) {
 		struct page *page = node_page(node, pfn);
-		int order = pfn_max_order(pfn);
+		int order = pfn_max_order(node->begin_pfn + pfn);
 
 		/**
 		 * Actually we need not check that order is non negative
 		 * because order originally non negative and goes less
-		 * while (1 << order) > pages and pages is positive, so
+		 * while pfn + (1 << order) > end and end > pfn, so
 		 * order never get less than zero.
 		 * But clang static checker complains about it, so i've
 		 * added order check in loop condition
 		 */
-		while (order && pfn + ((pfn_t)1 << order) > pages)
+		while (order && pfn + ((pfn_t)1 << order) > end)
 			--order;
 
-		free_pages_node(page, order, node);
+		buddy_free_pages_node(page, order, node);
 		pfn += (pfn_t)1 << order;
 	}
 }
 
+static void __memory_free_region(unsigned long long begin,
+			unsigned long long end)
+{
+	const pfn_t e = end >> PAGE_BITS;
+	pfn_t b = begin >> PAGE_BITS;
+
+	/* with CONFIG_MEMORY_NODE_SIZE a region may span several nodes */
+	while (b != e) {
+		struct memory_node *node = pfn_node(b);
+		const pfn_t node_end = MINU(e, node->end_pfn);
+
+		__memory_free_node_region(node, b - node->begin_pfn,
+					node_end - node->begin_pfn);
+		b = node_end;
+	}
+}
+
 void memory_free_region(unsigned long long addr, unsigned long long size)
 {
 	const unsigned long long begin = ALIGN(addr, PAGE_SIZE);
@@ -203,6 +275,10 @@ void setup_buddy(void)
 		list_splice(type_nodes + i, &node_order);
 		node_type[i] = node_order.next;
 	}
+
+#ifdef CONFIG_LAZY_BUDDY
+	set_lazy_buddy(true);
+#endif
 }
 
 struct page *pfn2page(pfn_t pfn)
@@ -237,40 +313,108 @@ pfn_t max_pfns(void)
 static pfn_t buddy_pfn(pfn_t pfn, int order)
 { return pfn ^ ((pfn_t)1 << order); }
 
-static struct page *__alloc_pages_node(int order, struct memory_node *node)
+/*
+ * Blocks are aligned to their size in absolute pfns, so huge pages
+ * are physically aligned even if the node begins at an odd address.
+ * A buddy before the node start wraps around and is beyond node end.
+ */
+static pfn_t node_buddy_pfn(const struct memory_node *node, pfn_t pfn,
+			int order)
+{ return buddy_pfn(node->begin_pfn + pfn, order) - node->begin_pfn; }
+
+static void buddy_list_add(struct memory_node *node, struct page *page,
+			int order)
 {
-	int coorder = order;
+	list_add(&page->link, &node->free_list[order]);
+	node->free_mask |= 1ul << order;
+	++node->free_count[order];
+}
 
-	while (coorder < BUDDY_ORDERS) {
-		if (!list_empty(&node->free_list[coorder]))
-			break;
-		++coorder;
-	}
+static void buddy_list_del(struct memory_node *node, struct page *page,
+			int order)
+{
+	list_del(&page->link);
+	if (!--node->free_count[order])
+		node->free_mask &= ~(1ul << order);
+}
+
+static struct page *__buddy_alloc_pages_node(int order,
+			struct memory_node *node)
+{
+	const unsigned long mask = node->free_mask >> order;
 
-	if (coorder >= BUDDY_ORDERS)
+	if (!mask)
 		return 0;
 
+	int coorder = order + __builtin_ctzl(mask);
 	struct page *page = LIST_ENTRY(list_first(&node->free_list[coorder]),
 				struct page, link);
 
-	list_del(&page->link);
+	buddy_list_del(node, page, coorder);
 	page_set_busy(page);
 
 	while (coorder > order) {
 		const pfn_t pfn = node_pfn(node, page);
-		const pfn_t bpfn = buddy_pfn(pfn, --coorder);
+		const pfn_t bpfn = node_buddy_pfn(node, pfn, --coorder);
 		struct page *buddy = node_page(node, bpfn);
 
 		page_set_order(buddy, coorder);
 		page_set_free(buddy);
 
-		list_add(&buddy->link, &node->free_list[coorder]);
+		buddy_list_add(node, buddy, coorder);
+		++node->stats.splits;
 	}
 
 	return page;
 }
 
-struct page *alloc_pages_node(int order, struct memory_node *node)
+static void __buddy_free_pages_node(struct page *pages, int order,
+			struct memory_node *node);
+
+/* merges lazy blocks into the buddy until at most target pages left */
+static void __lazy_flush(struct memory_node *node, unsigned long target)
+{
+	++node->stats.lazy_flushes;
+	for (int order = BUDDY_ORDERS - 1; order >= 0; --order) {
+		struct list_head *list = &node->lazy_list[order];
+
+		while (node->lazy_pages > target && !list_empty(list)) {
+			struct page *page = LIST_ENTRY(list->prev,
+						struct page, link);
+
+			list_del(&page->link);
+			node->lazy_pages -= 1ul << order;
+			__buddy_free_pages_node(page, order, node);
+		}
+	}
+}
+
+static struct page *__alloc_pages_node(int order, struct memory_node *node)
+{
+	struct list_head *list = &node->lazy_list[order];
+
+	if (!list_empty(list)) {
+		struct page *page = LIST_ENTRY(list_first(list),
+					struct page, link);
+
+		list_del(&page->link);
+		node->lazy_pages -= 1ul << order;
+		++node->stats.lazy_hits;
+		return page;
+	}
+
+	struct page *page = __buddy_alloc_pages_node(order, node);
+
+	/* fragmentation pressure: merge everything we have and retry */
+	if (!page && node->lazy_pages) {
+		__lazy_flush(node, 0);
+		page = __buddy_alloc_pages_node(order, node);
+	}
+
+	return page;
+}
+
+static struct page *buddy_alloc_pages_node(int order, struct memory_node *node)
 {
 	const bool enabled = spin_lock_irqsave(&node->lock);
 	struct page * pages = __alloc_pages_node(order, node);
@@ -283,10 +427,29 @@ struct page *alloc_pages_node(int order, struct memory_node *node)
 static void dump_buddy_node_state(struct memory_node *node)
 {
 	for (int i = 0; i != BUDDY_ORDERS; ++i) {
-		const int sz = list_size(&node->free_list[i]);
+		const unsigned long sz = node->free_count[i];
 
 		if (sz)
-			printf("\torder %d: %d\n", i, sz);
+			printf("\torder %d: %lu\n", i, sz);
+	}
+
+	const struct buddy_stats *stats = &node->stats;
+
+	printf("\tsplits %lu, merges %lu\n", stats->splits, stats->merges);
+	printf("\tlazy %s: %lu pages, frees %lu, hits %lu, flushes %lu\n",
+		node->lazy ? "on" : "off", node->lazy_pages,
+		stats->lazy_frees, stats->lazy_hits, stats->lazy_flushes);
+	printf("\tnuma hit %lu, miss %lu, foreign %lu\n",
+		node->numa_hit, node->numa_miss, node->numa_foreign);
+	printf("\tzero pool %lu pages, hits %lu, misses %lu\n",
+		node->zero_count, node->zero_hits, node->zero_misses);
+
+	for (int i = 0; i != NR_CPUS; ++i) {
+		const struct per_cpu_pages *pcp = &node->pcp[i];
+
+		printf("\tcpu %d: hits %lu, misses %lu, refills %lu, "
+			"drains %lu\n", i, pcp->hits, pcp->misses,
+			pcp->refills, pcp->drains);
 	}
 }
 
@@ -300,14 +463,14 @@ void dump_buddy_state(void)
 	}
 }
 
-static void __free_pages_node(struct page *pages, int order,
+static void __buddy_free_pages_node(struct page *pages, int order,
 			struct memory_node *node)
 {
 	const pfn_t node_pfns = node->end_pfn - node->begin_pfn;
 	pfn_t pfn = node_pfn(node, pages);
 
 	while (order < BUDDY_ORDERS - 1) {
-		const pfn_t bpfn = buddy_pfn(pfn, order);
+		const pfn_t bpfn = node_buddy_pfn(node, pfn, order);
 
 		if (bpfn >= node_pfns)
 			break;
@@ -323,7 +486,8 @@ static void __free_pages_node(struct page *pages, int order,
 		if (order != page_get_order(buddy))
 			break;
 
-		list_del(&buddy->link);
+		buddy_list_del(node, buddy, order);
+		++node->stats.merges;
 		++order;
 
 		if (bpfn < pfn) {
@@ -335,34 +499,729 @@ static void __free_pages_node(struct page *pages, int order,
 	page_set_order(pages, order);
 	page_set_free(pages);
 
-	list_add(&pages->link, &node->free_list[order]);
+	buddy_list_add(node, pages, order);
 }
 
-void free_pages_node(struct page *pages, int order, struct memory_node *node)
+/**
+ * In lazy mode a freed block stays busy on the lazy list, so it can't be
+ * merged with its buddy, until either an allocation of the same order
+ * takes it back or the lazy lists grow above lazy_high.
+ */
+static void __free_pages_node(struct page *pages, int order,
+			struct memory_node *node)
 {
-	if (!pages)
+	if (!node->lazy) {
+		__buddy_free_pages_node(pages, order, node);
 		return;
+	}
+
+	list_add(&pages->link, &node->lazy_list[order]);
+	node->lazy_pages += 1ul << order;
+	++node->stats.lazy_frees;
+
+	if (node->lazy_pages > node->lazy_high)
+		__lazy_flush(node, node->lazy_high / 2);
+}
 
+static void buddy_free_pages_node(struct page *pages, int order,
+			struct memory_node *node)
+{
 	const bool enabled = spin_lock_irqsave(&node->lock);
 
 	__free_pages_node(pages, order, node);
 	spin_unlock_irqrestore(&node->lock, enabled);
 }
 
-struct page *__alloc_pages(int order, int type)
+static int pcp_batch(int order)
+{ return MAX(PCP_BATCH >> order, 1); }
+
+static int pcp_high(int order)
+{ return 4 * pcp_batch(order); }
+
+static void pcp_refill(struct memory_node *node, struct per_cpu_pages *pcp,
+			int order)
 {
-	const struct list_head *head = &node_order;
-	struct list_head *ptr = node_type[type];
+	const int batch = pcp_batch(order);
+	const bool enabled = spin_lock_irqsave(&node->lock);
+
+	for (int i = 0; i != batch; ++i) {
+		struct page *page = __alloc_pages_node(order, node);
+
+		if (!page)
+			break;
+
+		list_add_tail(&page->link, &pcp->list[order]);
+		++pcp->count[order];
+	}
+	spin_unlock_irqrestore(&node->lock, enabled);
+	++pcp->refills;
+}
+
+/* returns up to count coldest pages of the order back to the buddy */
+static void pcp_drain(struct memory_node *node, struct per_cpu_pages *pcp,
+			int order, int count)
+{
+	struct list_head *list = &pcp->list[order];
+	const bool enabled = spin_lock_irqsave(&node->lock);
+
+	while (count-- && !list_empty(list)) {
+		struct page *page = LIST_ENTRY(list->prev, struct page, link);
+
+		list_del(&page->link);
+		--pcp->count[order];
+		__free_pages_node(page, order, node);
+	}
+	spin_unlock_irqrestore(&node->lock, enabled);
+	++pcp->drains;
+}
+
+static struct page *pcp_alloc_pages_node(int order, struct memory_node *node)
+{
+	const bool enabled = local_preempt_save();
+	struct per_cpu_pages *pcp = &node->pcp[cpu_id()];
+	struct list_head *list = &pcp->list[order];
+	struct page *page = 0;
+
+	if (list_empty(list)) {
+		++pcp->misses;
+		pcp_refill(node, pcp, order);
+	} else {
+		++pcp->hits;
+	}
+
+	if (!list_empty(list)) {
+		page = LIST_ENTRY(list_first(list), struct page, link);
+		list_del(&page->link);
+		--pcp->count[order];
+	}
+	local_preempt_restore(enabled);
+
+	return page;
+}
+
+static void pcp_free_pages_node(struct page *pages, int order,
+			struct memory_node *node, bool cold)
+{
+	const bool enabled = local_preempt_save();
+	struct per_cpu_pages *pcp = &node->pcp[cpu_id()];
+
+	if (cold)
+		list_add_tail(&pages->link, &pcp->list[order]);
+	else
+		list_add(&pages->link, &pcp->list[order]);
+
+	if (++pcp->count[order] > pcp_high(order))
+		pcp_drain(node, pcp, order, pcp_batch(order));
+	local_preempt_restore(enabled);
+}
+
+static int pcp_alloc_pages_bulk_node(int order, int count,
+			struct page **pages, struct memory_node *node)
+{
+	const bool enabled = local_preempt_save();
+	struct per_cpu_pages *pcp = &node->pcp[cpu_id()];
+	struct list_head *list = &pcp->list[order];
+	int allocated = 0;
+
+	while (allocated != count && !list_empty(list)) {
+		struct page *page = LIST_ENTRY(list_first(list),
+					struct page, link);
+
+		list_del(&page->link);
+		--pcp->count[order];
+		pages[allocated++] = page;
+	}
+
+	if (allocated == count) {
+		++pcp->hits;
+		local_preempt_restore(enabled);
+		return allocated;
+	}
+
+	/* the rest goes straight from the buddy, no point to refill */
+	++pcp->misses;
+	const bool locked = spin_lock_irqsave(&node->lock);
+
+	while (allocated != count) {
+		struct page *page = __alloc_pages_node(order, node);
+
+		if (!page)
+			break;
+		pages[allocated++] = page;
+	}
+	spin_unlock_irqrestore(&node->lock, locked);
+	local_preempt_restore(enabled);
+
+	return allocated;
+}
+
+static int buddy_alloc_pages_bulk_node(int order, int count,
+			struct page **pages, struct memory_node *node)
+{
+	const bool enabled = spin_lock_irqsave(&node->lock);
+	int allocated = 0;
+
+	while (allocated != count) {
+		struct page *page = __alloc_pages_node(order, node);
+
+		if (!page)
+			break;
+		pages[allocated++] = page;
+	}
+	spin_unlock_irqrestore(&node->lock, enabled);
+
+	return allocated;
+}
+
+static void pcp_free_pages_bulk_node(int order, int count,
+			struct page **pages, struct memory_node *node)
+{
+	const bool enabled = local_preempt_save();
+	struct per_cpu_pages *pcp = &node->pcp[cpu_id()];
+
+	for (int i = 0; i != count; ++i)
+		list_add_tail(&pages[i]->link, &pcp->list[order]);
+	pcp->count[order] += count;
+
+	if (pcp->count[order] > pcp_high(order)) {
+		const int excess = pcp->count[order] - pcp_high(order);
+
+		pcp_drain(node, pcp, order, excess + pcp_batch(order));
+	}
+	local_preempt_restore(enabled);
+}
+
+static void buddy_free_pages_bulk_node(int order, int count,
+			struct page **pages, struct memory_node *node)
+{
+	const bool enabled = spin_lock_irqsave(&node->lock);
+
+	for (int i = 0; i != count; ++i)
+		__free_pages_node(pages[i], order, node);
+	spin_unlock_irqrestore(&node->lock, enabled);
+}
+
+int alloc_pages_bulk_node(int order, int count, struct page **pages,
+			struct memory_node *node)
+{
+	if (order < PCP_ORDERS)
+		return pcp_alloc_pages_bulk_node(order, count, pages, node);
+	return buddy_alloc_pages_bulk_node(order, count, pages, node);
+}
+
+void free_pages_bulk_node(int order, int count, struct page **pages,
+			struct memory_node *node)
+{
+	if (order < PCP_ORDERS)
+		pcp_free_pages_bulk_node(order, count, pages, node);
+	else
+		buddy_free_pages_bulk_node(order, count, pages, node);
+}
+
+struct page *alloc_pages_node(int order, struct memory_node *node)
+{
+	if (order < PCP_ORDERS)
+		return pcp_alloc_pages_node(order, node);
+	return buddy_alloc_pages_node(order, node);
+}
+
+static void __free_pages(struct page *pages, int order,
+			struct memory_node *node, bool cold)
+{
+	if (!pages)
+		return;
+
+	if (order < PCP_ORDERS)
+		pcp_free_pages_node(pages, order, node, cold);
+	else
+		buddy_free_pages_node(pages, order, node);
+}
+
+void free_pages_node(struct page *pages, int order, struct memory_node *node)
+{
+	__free_pages(pages, order, node, false);
+}
+
+static void zero_pool_drain(struct memory_node *node)
+{
+	LIST_HEAD(pages);
+
+	const bool enabled = spin_lock_irqsave(&node->lock);
+
+	list_splice(&node->zero_list, &pages);
+	node->zero_count = 0;
+	spin_unlock_irqrestore(&node->lock, enabled);
+
+	while (!list_empty(&pages)) {
+		struct page *page = LIST_ENTRY(list_first(&pages),
+					struct page, link);
+
+		list_del(&page->link);
+		__free_pages(page, 0, node, true);
+	}
+}
+
+void drain_pages(void)
+{
+	for (int i = 0; i != memory_nodes; ++i) {
+		struct memory_node *node = memory_node_get(i);
+
+		/* zeroed pages are only a cache, give them back first */
+		zero_pool_drain(node);
+
+		const bool enabled = local_preempt_save();
+		struct per_cpu_pages *pcp = &node->pcp[cpu_id()];
 
-	for (; ptr != head; ptr = ptr->next) {
-		struct memory_node *node = LIST_ENTRY(ptr, struct memory_node,
+		for (int order = 0; order != PCP_ORDERS; ++order)
+			pcp_drain(node, pcp, order, pcp->count[order]);
+		local_preempt_restore(enabled);
+	}
+}
+
+/* the list doesn't change while a reclaim walks it without the lock */
+static void shrinkers_lock_idle(bool *enabled)
+{
+	*enabled = spin_lock_irqsave(&shrinkers_lock);
+	while (shrinking) {
+		spin_unlock_irqrestore(&shrinkers_lock, *enabled);
+		schedule();
+		*enabled = spin_lock_irqsave(&shrinkers_lock);
+	}
+}
+
+void register_shrinker(struct shrinker *shrinker)
+{
+	bool enabled;
+
+	shrinkers_lock_idle(&enabled);
+	list_add_tail(&shrinker->link, &shrinkers);
+	spin_unlock_irqrestore(&shrinkers_lock, enabled);
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+	bool enabled;
+
+	shrinkers_lock_idle(&enabled);
+	list_del(&shrinker->link);
+	spin_unlock_irqrestore(&shrinkers_lock, enabled);
+}
+
+/*
+ * Shrinkers free objects into the slab and page allocators, so they
+ * can't run in the middle of an allocator update. Only contexts that
+ * can be preempted (no spinlock held) reclaim, and one at a time, the
+ * others just skip it. The lock isn't held while shrinkers run.
+ */
+unsigned long shrink_caches(unsigned long count)
+{
+	unsigned long freed = 0;
+
+	if (!local_preempt_enabled())
+		return 0;
+
+	bool enabled = spin_lock_irqsave(&shrinkers_lock);
+
+	if (shrinking) {
+		spin_unlock_irqrestore(&shrinkers_lock, enabled);
+		return 0;
+	}
+	shrinking = true;
+	spin_unlock_irqrestore(&shrinkers_lock, enabled);
+
+	for (struct list_head *ptr = shrinkers.next; ptr != &shrinkers;
+				ptr = ptr->next) {
+		struct shrinker *shrinker = LIST_ENTRY(ptr, struct shrinker,
 					link);
+
+		freed += shrinker->scan(shrinker, count);
+	}
+
+	enabled = spin_lock_irqsave(&shrinkers_lock);
+	shrinking = false;
+	spin_unlock_irqrestore(&shrinkers_lock, enabled);
+
+	return freed;
+}
+
+/* free blocks might be stuck in per-cpu lists unmerged or held by caches */
+static void reclaim_pages(void)
+{
+	shrink_caches(SHRINK_BATCH);
+	drain_pages();
+}
+
+void set_lazy_buddy(bool enable)
+{
+	for (int i = 0; i != memory_nodes; ++i) {
+		struct memory_node *node = memory_node_get(i);
+		const bool enabled = spin_lock_irqsave(&node->lock);
+
+		node->lazy = enable;
+		if (!enable)
+			__lazy_flush(node, 0);
+		spin_unlock_irqrestore(&node->lock, enabled);
+	}
+}
+
+void buddy_stats(struct buddy_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i != memory_nodes; ++i) {
+		struct memory_node *node = memory_node_get(i);
+		const bool enabled = spin_lock_irqsave(&node->lock);
+
+		stats->splits += node->stats.splits;
+		stats->merges += node->stats.merges;
+		stats->lazy_frees += node->stats.lazy_frees;
+		stats->lazy_hits += node->stats.lazy_hits;
+		stats->lazy_flushes += node->stats.lazy_flushes;
+		spin_unlock_irqrestore(&node->lock, enabled);
+	}
+}
+
+static struct mempolicy default_policy = { .mode = MPOL_LOCAL };
+
+static bool node_allowed(const struct memory_node *node, int type)
+{ return (int)node->type <= type; }
+
+static int interleave_node(struct mempolicy *policy, int type)
+{
+	for (int i = 1; i <= memory_nodes; ++i) {
+		const int id = (policy->next + i) % memory_nodes;
+
+		if (!nodemask_test(&policy->nodes, id))
+			continue;
+
+		if (node_allowed(&nodes[id], type))
+			return policy->next = id;
+	}
+	return MEMORY_NODE_NONE;
+}
+
+/**
+ * Walks nodes in the order the policy of the current thread wants them:
+ * the target node first (if any), then the rest of node_order starting
+ * from node_type[type].
+ */
+struct node_iter {
+	const struct mempolicy *policy;
+	struct memory_node *target;
+	struct list_head *ptr;
+	bool first;
+};
+
+static void node_iter_init(struct node_iter *iter, int type)
+{
+	struct thread *thread = current();
+	struct mempolicy *policy = thread ? &thread->policy : &default_policy;
+	const int home = thread ? thread->home_node : MEMORY_NODE_NONE;
+	int id = MEMORY_NODE_NONE;
+
+	switch (policy->mode) {
+	case MPOL_LOCAL:
+		id = home;
+		break;
+	case MPOL_PREFERRED:
+		id = policy->node;
+		break;
+	case MPOL_INTERLEAVE:
+		id = interleave_node(policy, type);
+		break;
+	case MPOL_BIND:
+		if (home != MEMORY_NODE_NONE
+				&& nodemask_test(&policy->nodes, home))
+			id = home;
+		break;
+	}
+
+	iter->policy = policy;
+	iter->target = 0;
+	iter->ptr = node_type[type];
+	iter->first = true;
+
+	if (id != MEMORY_NODE_NONE && id < memory_nodes
+			&& node_allowed(&nodes[id], type))
+		iter->target = &nodes[id];
+}
+
+static struct memory_node *node_iter_next(struct node_iter *iter)
+{
+	if (iter->first) {
+		iter->first = false;
+		if (iter->target)
+			return iter->target;
+	}
+
+	while (iter->ptr != &node_order) {
+		struct memory_node *node = LIST_ENTRY(iter->ptr,
+					struct memory_node, link);
+
+		iter->ptr = iter->ptr->next;
+		if (node == iter->target)
+			continue;
+
+		if (iter->policy->mode == MPOL_BIND
+				&& !nodemask_test(&iter->policy->nodes, node->id))
+			continue;
+
+		return node;
+	}
+
+	return 0;
+}
+
+static void numa_account(struct memory_node *target, struct memory_node *node,
+			unsigned long pages)
+{
+	if (!target || target == node) {
+		node->numa_hit += pages;
+		return;
+	}
+
+	node->numa_miss += pages;
+	target->numa_foreign += pages;
+}
+
+static struct page *__alloc_pages_policy(int order, int type)
+{
+	struct memory_node *node;
+	struct node_iter iter;
+
+	node_iter_init(&iter, type);
+	while ((node = node_iter_next(&iter))) {
 		struct page *pages = alloc_pages_node(order, node);
 
-		if (pages)
+		if (pages) {
+			numa_account(iter.target, node, 1);
+			return pages;
+		}
+	}
+
+	return 0;
+}
+
+static int __alloc_pages_bulk_policy(int order, int count,
+			struct page **pages, int type)
+{
+	struct thread *thread = current();
+	int allocated = 0;
+
+	/* every page goes to its own node, so no batching possible */
+	if (thread && thread->policy.mode == MPOL_INTERLEAVE) {
+		while (allocated != count) {
+			struct page *page = __alloc_pages_policy(order, type);
+
+			if (!page)
+				break;
+			pages[allocated++] = page;
+		}
+		return allocated;
+	}
+
+	struct memory_node *node;
+	struct node_iter iter;
+
+	node_iter_init(&iter, type);
+	while (allocated != count && (node = node_iter_next(&iter))) {
+		const int got = alloc_pages_bulk_node(order, count - allocated,
+					pages + allocated, node);
+
+		if (got)
+			numa_account(iter.target, node, got);
+		allocated += got;
+	}
+
+	return allocated;
+}
+
+int __alloc_pages_bulk(int order, int count, struct page **pages, int type)
+{
+	int allocated = __alloc_pages_bulk_policy(order, count, pages, type);
+
+	if (allocated == count)
+		return allocated;
+
+	reclaim_pages();
+	return allocated + __alloc_pages_bulk_policy(order, count - allocated,
+				pages + allocated, type);
+}
+
+int alloc_pages_bulk(int order, int count, struct page **pages)
+{
+	return __alloc_pages_bulk(order, count, pages, NT_HIGH);
+}
+
+struct page *__alloc_pages(int order, int type)
+{
+	struct page *pages = __alloc_pages_policy(order, type);
+
+	if (pages)
+		return pages;
+
+	reclaim_pages();
+	return __alloc_pages_policy(order, type);
+}
+
+static struct page *zero_pool_alloc(struct memory_node *node)
+{
+	struct page *page = 0;
+	const bool enabled = spin_lock_irqsave(&node->lock);
+
+	if (!list_empty(&node->zero_list)) {
+		page = LIST_ENTRY(list_first(&node->zero_list),
+					struct page, link);
+		list_del(&page->link);
+		--node->zero_count;
+		++node->zero_hits;
+	} else {
+		++node->zero_misses;
+	}
+	spin_unlock_irqrestore(&node->lock, enabled);
+
+	return page;
+}
+
+static struct page *__alloc_zeroed_pages_policy(int order, int type)
+{
+	struct memory_node *node;
+	struct node_iter iter;
+
+	node_iter_init(&iter, type);
+	while ((node = node_iter_next(&iter))) {
+		struct page *pages = order ? 0 : zero_pool_alloc(node);
+
+		if (!pages && (pages = alloc_pages_node(order, node)))
+			memset(page_addr(pages), 0, PAGE_SIZE << order);
+
+		if (pages) {
+			numa_account(iter.target, node, 1);
 			return pages;
+		}
+	}
+
+	return 0;
+}
+
+struct page *__alloc_zeroed_pages(int order, int type)
+{
+	struct page *pages = __alloc_zeroed_pages_policy(order, type);
+
+	if (pages)
+		return pages;
+
+	reclaim_pages();
+	return __alloc_zeroed_pages_policy(order, type);
+}
+
+/* takes only pages zeroed in advance, returns how many there were */
+int __alloc_zeroed_pages_pool(int count, struct page **pages, int type)
+{
+	struct memory_node *node;
+	struct node_iter iter;
+	int allocated = 0;
+
+	node_iter_init(&iter, type);
+	while (allocated != count && (node = node_iter_next(&iter))) {
+		const bool enabled = spin_lock_irqsave(&node->lock);
+		int got = 0;
+
+		while (allocated != count && !list_empty(&node->zero_list)) {
+			struct page *page = LIST_ENTRY(
+						list_first(&node->zero_list),
+						struct page, link);
+
+			list_del(&page->link);
+			--node->zero_count;
+			pages[allocated++] = page;
+			++got;
+		}
+		node->zero_hits += got;
+		spin_unlock_irqrestore(&node->lock, enabled);
+
+		if (got)
+			numa_account(iter.target, node, got);
+	}
+
+	return allocated;
+}
+
+struct page *alloc_zeroed_pages(int order)
+{
+	return __alloc_zeroed_pages(order, NT_HIGH);
+}
+
+/* zeroes at most ZERO_POOL_BATCH pages per node, so idle stays short */
+void refill_zeroed_pages(void)
+{
+	for (int i = 0; i != memory_nodes; ++i) {
+		struct memory_node *node = memory_node_get(i);
+
+		for (int j = 0; j != ZERO_POOL_BATCH; ++j) {
+			if (node->zero_count >= node->zero_high)
+				break;
+
+			struct page *page = alloc_pages_node(0, node);
+
+			if (!page)
+				break;
+
+			memset(page_addr(page), 0, PAGE_SIZE);
+
+			const bool enabled = spin_lock_irqsave(&node->lock);
+
+			list_add(&page->link, &node->zero_list);
+			++node->zero_count;
+			spin_unlock_irqrestore(&node->lock, enabled);
+		}
+	}
+}
+
+int set_mempolicy(enum mempolicy_mode mode, int node,
+			const struct nodemask *nodes)
+{
+	struct mempolicy *policy = &current()->policy;
+	bool found = false;
+
+	switch (mode) {
+	case MPOL_LOCAL:
+		break;
+	case MPOL_PREFERRED:
+		if (node < 0 || node >= memory_nodes)
+			return -EINVAL;
+		break;
+	case MPOL_INTERLEAVE:
+	case MPOL_BIND:
+		if (!nodes)
+			return -EINVAL;
+
+		for (int i = 0; i != memory_nodes && !found; ++i)
+			found = nodemask_test(nodes, i);
+
+		if (!found)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
 	}
 
+	policy->mode = mode;
+	policy->node = node;
+	policy->next = MEMORY_NODE_NONE;
+	if (nodes)
+		policy->nodes = *nodes;
+	else
+		nodemask_clear(&policy->nodes);
+
+	return 0;
+}
+
+int set_home_node(int node)
+{
+	if (node != MEMORY_NODE_NONE && (node < 0 || node >= memory_nodes))
+		return -EINVAL;
+
+	current()->home_node = node;
 	return 0;
 }
 
@@ -380,3 +1239,29 @@ void free_pages(struct page *pages, int order)
 
 	free_pages_node(pages, order, node);
 }
+
+void free_cold_pages(struct page *pages, int order)
+{
+	if (!pages)
+		return;
+
+	struct memory_node *node = page_node(pages);
+
+	__free_pages(pages, order, node, true);
+}
+
+void free_pages_bulk(int order, int count, struct page **pages)
+{
+	int i = 0;
+
+	while (i != count) {
+		struct memory_node *node = page_node(pages[i]);
+		int j = i + 1;
+
+		while (j != count && page_node(pages[j]) == node)
+			++j;
+
+		free_pages_bulk_node(order, j - i, pages + i, node);
+		i = j;
+	}
+}
@@ -20,12 +20,16 @@
 #ifndef __ASM_FILE__
 
 #define BUDDY_ORDERS      12
+#define PCP_ORDERS        4
+#define PCP_BATCH         16
 #define BUDDY_ORDER_BITS  8ul
 #define PAGE_NODE_BITS    8ul
 #define PAGE_NODE_MASK    (BIT_CONST(PAGE_NODE_BITS) - 1)
 #define PAGE_BUSY_BIT     PAGE_NODE_BITS
 #define PAGE_BUSY_MASK    BIT_CONST(PAGE_BUSY_BIT)
 #define PADDR_BITS        48
+#define MAX_MEMORY_NODES  (1 << PAGE_NODE_BITS)
+#define MEMORY_NODE_NONE  -1
 
 #ifdef CONFIG_KERNEL_SIZE
 #define KERNEL_SIZE       CONFIG_KERNEL_SIZE
@@ -49,6 +53,7 @@
 #include "locking.h"
 #include "balloc.h"
 #include "list.h"
+#include "cpu.h"
 
 typedef uintptr_t pfn_t;
 typedef uintptr_t phys_t;
@@ -109,6 +114,75 @@ enum node_type {
 	NT_COUNT
 };
 
+/**
+ * Per-cpu lists of free pages of low orders, so that the most common
+ * requests neither take node lock nor split/merge buddies. Recently
+ * freed (hot) pages go to the head of the list, cold pages go to the
+ * tail, allocations are served from the head. Must be accessed with
+ * preemption disabled.
+ */
+struct per_cpu_pages {
+	struct list_head list[PCP_ORDERS];
+	int count[PCP_ORDERS];
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long refills;
+	unsigned long drains;
+};
+
+/**
+ * Split/merge statistics of a node. In lazy mode freed blocks are kept
+ * unmerged on the lazy lists, every lazy hit is an allocation that was
+ * served from there and so saved both the merge on free and the split
+ * on allocation.
+ */
+struct buddy_stats {
+	unsigned long splits;
+	unsigned long merges;
+	unsigned long lazy_frees;
+	unsigned long lazy_hits;
+	unsigned long lazy_flushes;
+};
+
+enum mempolicy_mode {
+	MPOL_LOCAL,      // home node of the thread first
+	MPOL_PREFERRED,  // the given node first
+	MPOL_INTERLEAVE, // round robin over the nodes in the mask
+	MPOL_BIND        // only nodes in the mask, home node first
+};
+
+#define NODEMASK_BITS     (8 * sizeof(unsigned long))
+#define NODEMASK_LONGS    (MAX_MEMORY_NODES / NODEMASK_BITS)
+
+struct nodemask {
+	unsigned long bits[NODEMASK_LONGS];
+};
+
+static inline void nodemask_clear(struct nodemask *mask)
+{
+	for (size_t i = 0; i != NODEMASK_LONGS; ++i)
+		mask->bits[i] = 0;
+}
+
+static inline void nodemask_set(struct nodemask *mask, int node)
+{ mask->bits[node / NODEMASK_BITS] |= 1ul << (node % NODEMASK_BITS); }
+
+static inline bool nodemask_test(const struct nodemask *mask, int node)
+{ return (mask->bits[node / NODEMASK_BITS] >> (node % NODEMASK_BITS)) & 1; }
+
+/**
+ * Per-thread allocation policy, fallback to the rest of the nodes in
+ * node_order happens for every mode except MPOL_BIND. Policy is only
+ * changed by the thread it belongs to, so it needs no locking.
+ */
+struct mempolicy {
+	enum mempolicy_mode mode;
+	int node;
+	int next; // last node used by interleave
+	struct nodemask nodes;
+};
+
 struct memory_node {
 	struct list_head link;
 	struct page *mmap;
@@ -119,11 +193,42 @@ struct memory_node {
 	enum node_type type;
 
 	struct list_head free_list[BUDDY_ORDERS];
+	unsigned long free_count[BUDDY_ORDERS];
+	unsigned long free_mask; // bit i is set iff free_list[i] isn't empty
+	struct per_cpu_pages pcp[NR_CPUS];
+
+	/* lazy buddy: recently freed blocks not merged yet */
+	bool lazy;
+	struct list_head lazy_list[BUDDY_ORDERS];
+	unsigned long lazy_pages;
+	unsigned long lazy_high;
+	struct buddy_stats stats;
+
+	/* order 0 pages zeroed in advance by idle, protected by lock */
+	struct list_head zero_list;
+	unsigned long zero_count;
+	unsigned long zero_high;
+	unsigned long zero_hits;
+	unsigned long zero_misses;
+
+	/**
+	 * hit - allocated on the node the policy asked for,
+	 * miss - allocated here while the policy asked for another node,
+	 * foreign - the policy asked for this node, but allocated elsewhere.
+	 * Updated without lock, so they are approximate.
+	 */
+	unsigned long numa_hit;
+	unsigned long numa_miss;
+	unsigned long numa_foreign;
 };
 
 void memory_free_region(unsigned long long addr, unsigned long long size);
 
 struct memory_node *memory_node_get(int id);
+int memory_nodes_count(void);
+int set_mempolicy(enum mempolicy_mode mode, int node,
+			const struct nodemask *nodes);
+int set_home_node(int node);
 pfn_t max_pfns(void);
 struct page *pfn2page(pfn_t pfn);
 pfn_t page2pfn(const struct page *page);
@@ -132,6 +237,53 @@ void free_pages_node(struct page *pages, int order, struct memory_node *node);
 struct page *__alloc_pages(int order, int type);
 struct page *alloc_pages(int order);
 void free_pages(struct page *pages, int order);
+void free_cold_pages(struct page *pages, int order);
+
+/**
+ * Bulk versions take node lock once for the whole batch. Allocation
+ * may succeed partially and returns number of pages stored in the
+ * array. All pages freed in bulk must be non-zero, they are considered
+ * cold.
+ */
+int alloc_pages_bulk_node(int order, int count, struct page **pages,
+			struct memory_node *node);
+void free_pages_bulk_node(int order, int count, struct page **pages,
+			struct memory_node *node);
+int __alloc_pages_bulk(int order, int count, struct page **pages, int type);
+int alloc_pages_bulk(int order, int count, struct page **pages);
+void free_pages_bulk(int order, int count, struct page **pages);
+
+/**
+ * Returns zero-filled pages. Order 0 requests are served from the pool
+ * of pages zeroed in advance by refill_zeroed_pages (the idle thread),
+ * the rest are cleared on the spot. __alloc_zeroed_pages_pool only
+ * takes order 0 pages from the pool and may return fewer than asked.
+ */
+struct page *__alloc_zeroed_pages(int order, int type);
+struct page *alloc_zeroed_pages(int order);
+int __alloc_zeroed_pages_pool(int count, struct page **pages, int type);
+void refill_zeroed_pages(void);
+
+/**
+ * Shrinkers let caches built on top of the page allocator give back
+ * objects nobody uses when an allocation fails. scan is asked to free
+ * up to count objects and returns how many it actually freed, it must
+ * not allocate memory. Shrinkers run only from contexts that can be
+ * preempted, shrink_caches does nothing otherwise.
+ */
+struct shrinker {
+	struct list_head link;
+	unsigned long (*scan)(struct shrinker *, unsigned long count);
+};
+
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+unsigned long shrink_caches(unsigned long count);
+
+void drain_pages(void);
+void set_lazy_buddy(bool enable);
+void buddy_stats(struct buddy_stats *stats);
+void dump_buddy_state(void);
 
 static inline struct memory_node *page_node(const struct page *page)
 { return memory_node_get(page_node_id(page)); }
@@ -1,22 +1,24 @@
 #include "kmem_cache.h"
+#include "locking.h"
+#include "list.h"
 #include "memory.h"
 #include "string.h"
 #include "stdio.h"
+#include "error.h"
+#include "vfs.h"
 #include "mm.h"
 
 #include <stdbool.h>
 
 
 static struct kmem_cache *mm_cachep;
+static struct kmem_cache *vma_cachep;
 
-static struct page *alloc_page_table(void)
-{
-	struct page *page = alloc_pages(0);
+/* protects u.refcount of the user pages shared between mms */
+static DEFINE_SPINLOCK(mm_page_lock);
 
-	if (page)
-		memset(page_addr(page), 0, PAGE_SIZE);
-	return page;
-}
+static struct page *alloc_page_table(void)
+{ return alloc_zeroed_pages(0); }
 
 static void free_page_table(struct page *pt)
 {
@@ -27,8 +29,10 @@ static struct mm *alloc_mm(void)
 {
 	struct mm *mm = kmem_cache_alloc(mm_cachep);
 
-	if (mm)
+	if (mm) {
 		memset(mm, 0, sizeof(*mm));
+		list_init(&mm->vmas);
+	}
 	return mm;
 }
 
@@ -64,13 +68,516 @@ struct mm *create_mm(void)
 	return mm;
 }
 
+static bool mm_current(const struct mm *mm)
+{ return page_paddr(mm->pt) == load_pml4(); }
+
+static pte_t *mm_pml4(struct mm *mm)
+{ return page_addr(mm->pt); }
+
+static pte_t pte_flags(pte_t pte)
+{ return pte & ~(pte_t)BITS_CONST(47, 12); }
+
+/* returns true when the last reference to the page has been dropped */
+static bool mm_put_page(struct page *page)
+{
+	const bool enabled = spin_lock_irqsave(&mm_page_lock);
+	const bool last = --page->u.refcount == 0;
+	spin_unlock_irqrestore(&mm_page_lock, enabled);
+
+	return last;
+}
+
+static int mm_map_huge(struct mm *mm, virt_t vaddr)
+{
+	struct page *page = alloc_huge_page();
+
+	if (!page)
+		return -ENOMEM;
+
+	memset(page_addr(page), 0, HUGE_PAGE_SIZE);
+
+	const int rc = pt_populate_range_large(mm_pml4(mm), vaddr,
+				vaddr + HUGE_PAGE_SIZE);
+
+	if (rc) {
+		free_pages(page, HUGE_PAGE_ORDER);
+		return rc;
+	}
+
+	struct pt_iter iter;
+
+	pt_iter_set(&iter, mm_pml4(mm), vaddr);
+	DBG_ASSERT(iter.level == 1);
+	DBG_ASSERT(!pt_iter_present(&iter));
+
+	page->u.refcount = 1;
+	iter.pt[1][iter.idx[1]] = page_paddr(page) | PTE_LARGE | PTE_USER |
+				PTE_WRITE | PTE_PRESENT;
+	return 0;
+}
+
+static int mm_map_pages(struct mm *mm, virt_t from, virt_t to)
+{
+	for (virt_t vaddr = from; vaddr != to; vaddr += PAGE_SIZE) {
+		struct page *page = alloc_zeroed_pages(0);
+
+		if (!page)
+			return -ENOMEM;
+
+		const int rc = pt_populate_range(mm_pml4(mm), vaddr,
+					vaddr + PAGE_SIZE);
+
+		if (rc) {
+			free_pages(page, 0);
+			return rc;
+		}
+
+		struct pt_iter iter;
+
+		pt_iter_set(&iter, mm_pml4(mm), vaddr);
+		DBG_ASSERT(iter.level == 0);
+		DBG_ASSERT(!pt_iter_present(&iter));
+
+		page->u.refcount = 1;
+		iter.pt[0][iter.idx[0]] = page_paddr(page) | PTE_USER |
+					PTE_WRITE | PTE_PRESENT;
+	}
+
+	return 0;
+}
+
+int mm_alloc_range(struct mm *mm, virt_t from, virt_t to)
+{
+	DBG_ASSERT(from < to && to <= BIT_CONST(47));
+	DBG_ASSERT(!(from & PAGE_MASK) && !(to & PAGE_MASK));
+
+	virt_t vaddr = from;
+
+	while (vaddr != to) {
+		if (!(vaddr & HUGE_PAGE_MASK) && to - vaddr >= HUGE_PAGE_SIZE
+					&& !mm_map_huge(mm, vaddr)) {
+			vaddr += HUGE_PAGE_SIZE;
+			continue;
+		}
+
+		/* no order 9 block or unaligned part, fallback to 4K */
+		const virt_t next = MINU(ALIGN(vaddr + 1, HUGE_PAGE_SIZE), to);
+		const int rc = mm_map_pages(mm, vaddr, next);
+
+		if (rc) {
+			/* the last chunk might be mapped partially */
+			virt_t end = vaddr;
+			struct pt_iter iter;
+
+			for_each_slot_in_range(mm_pml4(mm), vaddr, next, iter) {
+				if (!pt_iter_present(&iter))
+					break;
+				end = iter.addr + PAGE_SIZE;
+			}
+
+			if (end != from)
+				mm_free_range(mm, from, end);
+			return rc;
+		}
+		vaddr = next;
+	}
+
+	return 0;
+}
+
+void mm_free_range(struct mm *mm, virt_t from, virt_t to)
+{
+	struct tlb_gather tlb;
+	struct pt_iter iter;
+
+	tlb_gather_init(&tlb, mm_current(mm));
+
+	for_each_slot_in_range(mm_pml4(mm), from, to, iter) {
+		const int level = iter.level;
+		const int idx = iter.idx[level];
+		const pte_t pte = iter.pt[level][idx];
+
+		if (!pte_present(pte))
+			continue;
+
+		struct page *page = pfn2page(pte_phys(pte) >> PAGE_BITS);
+
+		DBG_ASSERT(level == 0 || (level == 1 && pte_large(pte)));
+		DBG_ASSERT(iter.addr >= from);
+		iter.pt[level][idx] = 0;
+		tlb_gather_range(&tlb, iter.addr, iter.addr + PAGE_SIZE);
+		if (mm_put_page(page))
+			tlb_gather_free(&tlb, page, level ? HUGE_PAGE_ORDER : 0);
+	}
+	tlb_gather_finish(&tlb);
+
+	pt_release_range(mm_pml4(mm), from, to);
+}
+
+/* frees all user pages and page tables, mm must not be in use */
+static void mm_release_pt(pte_t *pt, int level, int entries)
+{
+	for (int i = 0; i != entries; ++i) {
+		const pte_t pte = pt[i];
+
+		if (!pte_present(pte))
+			continue;
+
+		struct page *page = pfn2page(pte_phys(pte) >> PAGE_BITS);
+
+		if (level == 0) {
+			if (mm_put_page(page))
+				free_pages(page, 0);
+		} else if (pte_large(pte)) {
+			DBG_ASSERT(level == 1);
+			if (mm_put_page(page))
+				free_pages(page, HUGE_PAGE_ORDER);
+		} else {
+			mm_release_pt(va(pte_phys(pte)), level - 1, PT_SIZE);
+			free_page_table(page);
+		}
+	}
+}
+
+static struct vma *alloc_vma(virt_t begin, virt_t end, struct fs_node *node,
+			size_t offset)
+{
+	struct vma *vma = kmem_cache_alloc(vma_cachep);
+
+	if (vma) {
+		vma->begin = begin;
+		vma->end = end;
+		vma->node = vfs_node_get(node);
+		vma->offset = offset;
+	}
+	return vma;
+}
+
+static void free_vma(struct vma *vma)
+{
+	vfs_node_put(vma->node);
+	kmem_cache_free(vma_cachep, vma);
+}
+
+static void mm_release_vmas(struct mm *mm)
+{
+	while (!list_empty(&mm->vmas)) {
+		struct vma *vma = LIST_ENTRY(list_first(&mm->vmas),
+					struct vma, link);
+
+		list_del(&vma->link);
+		free_vma(vma);
+	}
+}
+
 void release_mm(struct mm *mm)
 {
+	mm_release_vmas(mm);
+	mm_release_pt(mm_pml4(mm), PT_MAX_LEVEL, pml4_i(HIGH_BASE));
 	free_page_table(mm->pt);
 	free_mm(mm);
 }
 
+/*
+ * Copies page tables of src into dst, pages are shared and writable
+ * ones become copy-on-write in both. On failure dst is left partially
+ * filled, but consistent, so release_mm can free it.
+ */
+static int mm_clone_pt(pte_t *dst, pte_t *src, int level, int entries)
+{
+	for (int i = 0; i != entries; ++i) {
+		pte_t pte = src[i];
+
+		if (!pte_present(pte))
+			continue;
+
+		if (level == 0 || pte_large(pte)) {
+			struct page *page = pfn2page(pte_phys(pte) >> PAGE_BITS);
+
+			DBG_ASSERT(level <= 1);
+			if (pte_write(pte))
+				pte = (pte & ~PTE_WRITE) | PTE_COW;
+			++page->u.refcount;
+			dst[i] = src[i] = pte;
+			continue;
+		}
+
+		const struct page *orig = pfn2page(pte_phys(pte) >> PAGE_BITS);
+		struct page *pt = alloc_page_table();
+
+		if (!pt)
+			return -ENOMEM;
+
+		/* pt_populate_range accounting must be the same in both */
+		pt->u.refcount = orig->u.refcount;
+		dst[i] = page_paddr(pt) | pte_flags(pte);
+
+		const int rc = mm_clone_pt(page_addr(pt), va(pte_phys(pte)),
+					level - 1, PT_SIZE);
+
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int mm_clone_vmas(struct mm *dst, struct mm *src)
+{
+	for (struct list_head *ptr = src->vmas.next; ptr != &src->vmas;
+				ptr = ptr->next) {
+		const struct vma *vma = LIST_ENTRY(ptr, struct vma, link);
+		struct vma *copy = alloc_vma(vma->begin, vma->end, vma->node,
+					vma->offset);
+
+		if (!copy)
+			return -ENOMEM;
+		list_add_tail(&copy->link, &dst->vmas);
+	}
+	return 0;
+}
+
+struct mm *clone_mm(struct mm *mm)
+{
+	struct mm *new = create_mm();
+
+	if (!new)
+		return 0;
+
+	if (mm_clone_vmas(new, mm)) {
+		release_mm(new);
+		return 0;
+	}
+
+	const bool enabled = spin_lock_irqsave(&mm_page_lock);
+	const int rc = mm_clone_pt(mm_pml4(new), mm_pml4(mm), PT_MAX_LEVEL,
+				pml4_i(HIGH_BASE));
+	spin_unlock_irqrestore(&mm_page_lock, enabled);
+
+	/* writable entries of mm might be cached in the TLB */
+	if (mm_current(mm))
+		flush_tlb_all();
+
+	if (rc) {
+		release_mm(new);
+		return 0;
+	}
+
+	new->stack_pointer = mm->stack_pointer;
+	return new;
+}
+
+static struct vma *mm_find_vma(struct mm *mm, virt_t addr)
+{
+	for (struct list_head *ptr = mm->vmas.next; ptr != &mm->vmas;
+				ptr = ptr->next) {
+		struct vma *vma = LIST_ENTRY(ptr, struct vma, link);
+
+		if (addr < vma->begin)
+			break;
+		if (addr < vma->end)
+			return vma;
+	}
+	return 0;
+}
+
+int mm_map(struct mm *mm, virt_t from, virt_t to, struct fs_node *node,
+			size_t offset)
+{
+	DBG_ASSERT(from < to && to <= BIT_CONST(47));
+	DBG_ASSERT(!(from & PAGE_MASK) && !(to & PAGE_MASK));
+	DBG_ASSERT(!(offset & PAGE_MASK));
+	DBG_ASSERT(!node || node->ops->readpage);
+
+	struct list_head *ptr = mm->vmas.next;
+
+	for (; ptr != &mm->vmas; ptr = ptr->next) {
+		const struct vma *vma = LIST_ENTRY(ptr, struct vma, link);
+
+		if (vma->end <= from)
+			continue;
+		if (vma->begin < to)
+			return -EBUSY;
+		break;
+	}
+
+	struct vma *vma = alloc_vma(from, to, node, offset);
+
+	if (!vma)
+		return -ENOMEM;
+
+	/*
+	 * Page tables are populated for the whole vma, so mm_free_range
+	 * can release them the same way as for mm_alloc_range regions.
+	 */
+	const int rc = pt_populate_range(mm_pml4(mm), from, to);
+
+	if (rc) {
+		free_vma(vma);
+		return rc;
+	}
+
+	list_add_tail(&vma->link, ptr);
+	return 0;
+}
+
+int mm_unmap(struct mm *mm, virt_t from, virt_t to)
+{
+	DBG_ASSERT(from < to && to <= BIT_CONST(47));
+	DBG_ASSERT(!(from & PAGE_MASK) && !(to & PAGE_MASK));
+
+	struct list_head *ptr = mm->vmas.next;
+
+	while (ptr != &mm->vmas) {
+		struct vma *vma = LIST_ENTRY(ptr, struct vma, link);
+
+		ptr = ptr->next;
+		if (vma->end <= from)
+			continue;
+		if (vma->begin >= to)
+			break;
+
+		const virt_t begin = MAXU(vma->begin, from);
+		const virt_t end = MINU(vma->end, to);
+
+		if (begin != vma->begin && end != vma->end) {
+			struct vma *tail = alloc_vma(end, vma->end, vma->node,
+						vma->offset + (end - vma->begin));
+
+			if (!tail)
+				return -ENOMEM;
+
+			list_add(&tail->link, &vma->link);
+			vma->end = begin;
+		} else if (begin != vma->begin) {
+			vma->end = begin;
+		} else if (end != vma->end) {
+			vma->offset += end - vma->begin;
+			vma->begin = end;
+		} else {
+			list_del(&vma->link);
+			free_vma(vma);
+		}
+
+		mm_free_range(mm, begin, end);
+	}
+
+	return 0;
+}
+
+static int mm_fault_absent(struct mm *mm, virt_t addr)
+{
+	struct vma *vma = mm_find_vma(mm, addr);
+
+	if (!vma)
+		return -EFAULT;
+
+	const virt_t vaddr = addr & ~(virt_t)PAGE_MASK;
+	struct page *page = vma->node ? alloc_pages(0) : alloc_zeroed_pages(0);
+
+	if (!page)
+		return -ENOMEM;
+
+	if (vma->node) {
+		const size_t offset = vma->offset + (vaddr - vma->begin);
+		struct fs_node *node = vma->node;
+		const int rc = node->ops->readpage(node, offset >> PAGE_BITS,
+					page_addr(page));
+
+		if (rc) {
+			free_pages(page, 0);
+			return rc;
+		}
+	}
+
+	struct pt_iter iter;
+
+	pt_iter_set(&iter, mm_pml4(mm), vaddr);
+	DBG_ASSERT(iter.level == 0);
+
+	/* readpage might sleep, but nobody else maps pages in this mm */
+	DBG_ASSERT(!pt_iter_present(&iter));
+	page->u.refcount = 1;
+	iter.pt[0][iter.idx[0]] = page_paddr(page) | PTE_USER | PTE_WRITE |
+				PTE_PRESENT;
+	return 0;
+}
+
+static int mm_fault_cow(struct mm *mm, virt_t addr)
+{
+	struct pt_iter iter;
+
+	pt_iter_set(&iter, mm_pml4(mm), addr);
+
+	const int level = iter.level;
+	const int idx = iter.idx[level];
+	const pte_t pte = iter.pt[level][idx];
+
+	if (!pte_present(pte) || !pte_cow(pte))
+		return -EFAULT;
+
+	DBG_ASSERT(level == 0 || (level == 1 && pte_large(pte)));
+
+	const int order = level ? HUGE_PAGE_ORDER : 0;
+	const pte_t flags = (pte_flags(pte) & ~PTE_COW) | PTE_WRITE;
+	struct page *page = pfn2page(pte_phys(pte) >> PAGE_BITS);
+
+	struct page *copy = 0;
+	bool enabled = spin_lock_irqsave(&mm_page_lock);
+	const bool shared = page->u.refcount != 1;
+
+	spin_unlock_irqrestore(&mm_page_lock, enabled);
+
+	/*
+	 * The copy is made without the lock, our mapping keeps the page
+	 * alive meanwhile. Other users might go away in the meantime, so
+	 * the refcount is checked again before the copy is used.
+	 */
+	if (shared) {
+		copy = order ? alloc_huge_page() : alloc_pages(0);
+		if (!copy)
+			return -ENOMEM;
+		memcpy(page_addr(copy), page_addr(page), PAGE_SIZE << order);
+		copy->u.refcount = 1;
+	}
+
+	enabled = spin_lock_irqsave(&mm_page_lock);
+	/* another fault on the same address might have been faster */
+	if (iter.pt[level][idx] == pte) {
+		/* the last user of the page doesn't need a copy */
+		if (copy && page->u.refcount != 1) {
+			--page->u.refcount;
+			page = copy;
+			copy = 0;
+		}
+		iter.pt[level][idx] = page_paddr(page) | flags;
+	}
+	spin_unlock_irqrestore(&mm_page_lock, enabled);
+
+	if (copy)
+		free_pages(copy, order);
+
+	if (mm_current(mm))
+		flush_tlb_addr(addr);
+	return 0;
+}
+
+int mm_page_fault(struct mm *mm, virt_t addr, unsigned long error)
+{
+	if (addr >= BIT_CONST(47))
+		return -EFAULT;
+
+	if (!(error & PF_PRESENT))
+		return mm_fault_absent(mm, addr);
+
+	if (!(error & PF_WRITE))
+		return -EFAULT;
+
+	return mm_fault_cow(mm, addr);
+}
+
 void setup_mm(void)
 {
 	DBG_ASSERT((mm_cachep = KMEM_CACHE(struct mm)) != 0);
+	DBG_ASSERT((vma_cachep = KMEM_CACHE(struct vma)) != 0);
 }
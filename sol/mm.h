@@ -5,14 +5,77 @@
 #include "paging.h"
 
 
+struct fs_node;
+
+/**
+ * struct vma describes a region of user address space populated on
+ * demand: anonymous memory (node == 0) is zero-filled on the first
+ * touch, and file-backed regions get a private copy of the file page
+ * at offset + (addr - begin).
+ */
+struct vma {
+	struct list_head link;
+	virt_t begin;
+	virt_t end;
+	struct fs_node *node;
+	size_t offset;
+};
+
+/**
+ * vmas are sorted by address and don't overlap, the list isn't locked,
+ * so only the owner thread of mm or nobody must use it.
+ */
 struct mm {
 	struct page *pt;
+	struct list_head vmas;
 	uintptr_t stack_pointer;
 };
 
 
+#define PF_PRESENT BIT_CONST(0)
+#define PF_WRITE   BIT_CONST(1)
+#define PF_USER    BIT_CONST(2)
+
+
 struct mm *create_mm(void);
 void release_mm(struct mm *mm);
+
+/**
+ * Creates a copy of the user part of mm. Pages are not copied, but
+ * shared read-only until one of the sides writes to them, so the cost
+ * is proportional to the number of page tables.
+ */
+struct mm *clone_mm(struct mm *mm);
+
+/**
+ * Handles #PF at addr with the error code of the exception. Faults on
+ * absent pages inside a vma map a new page. Write faults on
+ * copy-on-write pages get a private copy of the page (or the page
+ * itself, if nobody else uses it). Returns -EFAULT if the fault isn't
+ * ours. Might sleep reading a file.
+ */
+int mm_page_fault(struct mm *mm, virt_t addr, unsigned long error);
+
+/**
+ * Maps zeroed anonymous memory in [from; to) of the user part of mm.
+ * Aligned 2MB chunks are mapped with huge pages when order 9 blocks
+ * are available, the rest with 4K pages. mm_free_range must not split
+ * a huge page.
+ */
+int mm_alloc_range(struct mm *mm, virt_t from, virt_t to);
+void mm_free_range(struct mm *mm, virt_t from, virt_t to);
+
+/**
+ * Creates a vma for [from; to) and allocates page tables for it, pages
+ * are allocated by the #PF handler. [from; to) must not overlap with
+ * other vmas. node is 0 for anonymous memory, otherwise offset is a
+ * page aligned offset inside the file and node must implement readpage.
+ */
+int mm_map(struct mm *mm, virt_t from, virt_t to, struct fs_node *node,
+			size_t offset);
+
+/* removes vmas in [from; to) and frees pages they use */
+int mm_unmap(struct mm *mm, virt_t from, virt_t to);
 void setup_mm(void);
 
 #endif /*__MM_H__*/
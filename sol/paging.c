@@ -2,6 +2,8 @@
 #include "string.h"
 #include "error.h"
 #include "stdio.h"
+#include "cpu.h"
+#include "rbtree.h"
 
 
 static int pt_index(virt_t vaddr, int level)
@@ -112,24 +114,195 @@ bool pt_iter_large(const struct pt_iter *iter)
 	return pte_large(iter->pt[level][index]);
 }
 
+#define TLB_FREE_BATCH 16
+
+static unsigned long tlb_avoided;
+static unsigned long tlb_invlpg;
+static unsigned long tlb_full;
+
+void tlb_gather_init(struct tlb_gather *tlb, bool active)
+{
+	tlb->from = tlb->to = 0;
+	tlb->pages = 0;
+	tlb->active = active;
+	list_init(&tlb->free);
+}
+
+void tlb_gather_range(struct tlb_gather *tlb, virt_t from, virt_t to)
+{
+	if (!tlb->active)
+		return;
+
+	if (!tlb->pages) {
+		tlb->from = from;
+		tlb->to = to;
+	} else {
+		tlb->from = MINU(tlb->from, from);
+		tlb->to = MAXU(tlb->to, to);
+	}
+	tlb->pages += (to - from) >> PAGE_BITS;
+}
+
+void tlb_gather_free(struct tlb_gather *tlb, struct page *pages, int order)
+{
+	page_set_order(pages, order);
+	list_add_tail(&pages->link, &tlb->free);
+}
+
+void tlb_gather_skip(size_t pages)
+{ tlb_avoided += pages; }
+
+void tlb_gather_flush(struct tlb_gather *tlb)
+{
+	if (!tlb->pages)
+		return;
+
+	const size_t range = (tlb->to - tlb->from) >> PAGE_BITS;
+	size_t done = 1;
+
+	if (range > TLB_FLUSH_ALL_PAGES) {
+		flush_tlb_all();
+		++tlb_full;
+	} else {
+		for (virt_t addr = tlb->from; addr != tlb->to;
+					addr += PAGE_SIZE)
+			flush_tlb_addr(addr);
+		tlb_invlpg += range;
+		done = range;
+	}
+
+	if (tlb->pages > done)
+		tlb_avoided += tlb->pages - done;
+	tlb->pages = 0;
+}
+
+void tlb_gather_finish(struct tlb_gather *tlb)
+{
+	struct page *pages[TLB_FREE_BATCH];
+	int count = 0;
+
+	tlb_gather_flush(tlb);
+	while (!list_empty(&tlb->free)) {
+		struct page *page = LIST_ENTRY(list_first(&tlb->free),
+					struct page, link);
+		const int order = page_get_order(page);
+
+		list_del(&page->link);
+		if (order) {
+			free_pages(page, order);
+			continue;
+		}
+
+		if (count == TLB_FREE_BATCH) {
+			free_pages_bulk(0, count, pages);
+			count = 0;
+		}
+		pages[count++] = page;
+	}
+	free_pages_bulk(0, count, pages);
+}
+
+void tlb_stats(unsigned long *invlpg, unsigned long *full,
+			unsigned long *avoided)
+{
+	*invlpg = tlb_invlpg;
+	*full = tlb_full;
+	*avoided = tlb_avoided;
+}
+
+/* kernel half is shared by all page tables, so it's always active */
+static bool pt_active(pte_t *pml4, virt_t vaddr)
+{ return linear(vaddr) >= linear(HIGH_BASE) || pa(pml4) == load_pml4(); }
+
+#define PT_BULK 16
+
+/**
+ * Page tables needed to populate a range are allocated in bulk on the
+ * first miss, the number is bounded by the count of pml3, pml2 and pml1
+ * slots the range spans. Pages that weren't used are returned by
+ * pt_bulk_release, as well as tables released on failure.
+ */
+struct pt_bulk {
+	struct page *page[PT_BULK];
+	int count;
+	int next;
+	bool zeroed; // pages came from the zero pool
+	pfn_t tables;
+	pte_t flags;
+	struct tlb_gather tlb;
+};
+
+static pfn_t pt_slots(virt_t from, virt_t to, int shift)
+{ return ((to - 1) >> shift) - (from >> shift) + 1; }
+
+static void pt_bulk_init(struct pt_bulk *bulk, pte_t *pml4, virt_t from,
+			virt_t to, pte_t flags)
+{
+	tlb_gather_init(&bulk->tlb, pt_active(pml4, from));
+	bulk->count = 0;
+	bulk->next = 0;
+	bulk->zeroed = false;
+	bulk->flags = flags;
+	bulk->tables = pt_slots(from, to, 39) + pt_slots(from, to, 30);
+	if (!pte_large(flags))
+		bulk->tables += pt_slots(from, to, 21);
+}
+
+static void pt_bulk_release(struct pt_bulk *bulk)
+{
+	free_pages_bulk(0, bulk->count - bulk->next, bulk->page + bulk->next);
+	bulk->count = bulk->next = 0;
+	tlb_gather_finish(&bulk->tlb);
+}
+
+
 static struct page *alloc_page_table(pte_t flags)
 {
-	struct page *page =
-		(flags & PTE_LOW) ? __alloc_pages(0, NT_LOW) : alloc_pages(0);
+	struct page *page = __alloc_zeroed_pages(0,
+				(flags & PTE_LOW) ? NT_LOW : NT_HIGH);
 
-	if (page) {
-		memset(va(page_paddr(page)), 0, PAGE_SIZE);
+	if (page)
 		page->u.refcount = 0;
+	return page;
+}
+
+static struct page *pt_bulk_alloc(struct pt_bulk *bulk)
+{
+	if (bulk->next == bulk->count) {
+		const int count = bulk->tables ? MINU(bulk->tables, PT_BULK) : 1;
+		const int type = (bulk->flags & PTE_LOW) ? NT_LOW : NT_HIGH;
+
+		/* tables cleared in advance keep memset off this path */
+		bulk->next = 0;
+		bulk->count = __alloc_zeroed_pages_pool(count, bulk->page, type);
+		bulk->zeroed = bulk->count != 0;
+		if (!bulk->zeroed)
+			bulk->count = __alloc_pages_bulk(0, count, bulk->page,
+						type);
+		if (!bulk->count)
+			return 0;
 	}
+
+	struct page *page = bulk->page[bulk->next++];
+
+	if (bulk->tables)
+		--bulk->tables;
+	if (!bulk->zeroed)
+		memset(page_addr(page), 0, PAGE_SIZE);
+	page->u.refcount = 0;
 	return page;
 }
 
-static void free_page_table(struct page *page)
+/* paging-structure caches may still reference the table until flush */
+static void pt_free_table(struct tlb_gather *tlb, struct page *page,
+			virt_t vaddr)
 {
-	free_pages(page, 0);
+	tlb_gather_range(tlb, canonical(vaddr), canonical(vaddr) + PAGE_SIZE);
+	tlb_gather_free(tlb, page, 0);
 }
 
-static void pt_release_pml2(pte_t *pml2, virt_t from, virt_t to)
+static void pt_release_pml2(pte_t *pml2, virt_t from, virt_t to,
+			struct tlb_gather *tlb)
 {
 	virt_t vaddr = from;
 
@@ -147,14 +320,15 @@ static void pt_release_pml2(pte_t *pml2, virt_t from, virt_t to)
 
 			if (pt->u.refcount == 0) {
 				pml2[i] = 0;
-				free_page_table(pt);
+				pt_free_table(tlb, pt, vaddr);
 			}
 		}
 		vaddr += bytes;	
 	}
 }
 
-static int pt_populate_pml2(pte_t *pml2, virt_t from, virt_t to, pte_t flags)
+static int pt_populate_pml2(pte_t *pml2, virt_t from, virt_t to, pte_t flags,
+			struct pt_bulk *bulk)
 {
 	virt_t vaddr = from;
 
@@ -164,10 +338,10 @@ static int pt_populate_pml2(pte_t *pml2, virt_t from, virt_t to, pte_t flags)
 		const pfn_t pages = bytes >> PAGE_BITS;
 
 		if (!pte_present(pml2[i]) && !pte_large(flags)) {
-			struct page *pt = alloc_page_table(flags);
+			struct page *pt = pt_bulk_alloc(bulk);
 
 			if (!pt) {
-				pt_release_pml2(pml2, from, vaddr);
+				pt_release_pml2(pml2, from, vaddr, &bulk->tlb);
 				return -ENOMEM;
 			}
 
@@ -185,7 +359,8 @@ static int pt_populate_pml2(pte_t *pml2, virt_t from, virt_t to, pte_t flags)
 	return 0;
 }
 
-static void pt_release_pml3(pte_t *pml3, virt_t from, virt_t to)
+static void pt_release_pml3(pte_t *pml3, virt_t from, virt_t to,
+			struct tlb_gather *tlb)
 {
 	virt_t vaddr = from;
 
@@ -200,19 +375,20 @@ static void pt_release_pml3(pte_t *pml3, virt_t from, virt_t to)
 			const pfn_t pfn = paddr >> PAGE_BITS;
 			struct page *pt = pfn2page(pfn);
 
-			pt_release_pml2(va(paddr), vaddr, vaddr + bytes);
+			pt_release_pml2(va(paddr), vaddr, vaddr + bytes, tlb);
 			pt->u.refcount -= pages;
 
 			if (pt->u.refcount == 0) {
 				pml3[i] = 0;
-				free_page_table(pt);
+				pt_free_table(tlb, pt, vaddr);
 			}
 		}
 		vaddr += bytes;	
 	}
 }
 
-static int pt_populate_pml3(pte_t *pml3, virt_t from, virt_t to, pte_t flags)
+static int pt_populate_pml3(pte_t *pml3, virt_t from, virt_t to, pte_t flags,
+			struct pt_bulk *bulk)
 {
 	virt_t vaddr = from;
 
@@ -224,10 +400,10 @@ static int pt_populate_pml3(pte_t *pml3, virt_t from, virt_t to, pte_t flags)
 		const pfn_t pages = bytes >> PAGE_BITS;
 
 		if (!pte_present(pml3[i])) {
-			pt = alloc_page_table(flags);
+			pt = pt_bulk_alloc(bulk);
 
 			if (!pt) {
-				pt_release_pml3(pml3, from, vaddr);
+				pt_release_pml3(pml3, from, vaddr, &bulk->tlb);
 				return -ENOMEM;
 			}
 
@@ -242,15 +418,15 @@ static int pt_populate_pml3(pte_t *pml3, virt_t from, virt_t to, pte_t flags)
 		pt->u.refcount += pages;
 
 		const int rc = pt_populate_pml2(va(paddr), vaddr, vaddr + bytes,
-					flags);
+					flags, bulk);
 
 		if (rc) {
-			pt_release_pml3(pml3, from, vaddr);
+			pt_release_pml3(pml3, from, vaddr, &bulk->tlb);
 			pt->u.refcount -= pages;
 
 			if (pt->u.refcount == 0) {
 				pml3[i] = 0;
-				free_page_table(pt);
+				pt_free_table(&bulk->tlb, pt, vaddr);
 			}
 
 			return rc;
@@ -261,7 +437,8 @@ static int pt_populate_pml3(pte_t *pml3, virt_t from, virt_t to, pte_t flags)
 	return 0;
 }
 
-static void pt_release_pml4(pte_t *pml4, virt_t from, virt_t to)
+static void pt_release_pml4(pte_t *pml4, virt_t from, virt_t to,
+			struct tlb_gather *tlb)
 {
 	virt_t vaddr = from;
 
@@ -276,19 +453,20 @@ static void pt_release_pml4(pte_t *pml4, virt_t from, virt_t to)
 			const pfn_t pfn = paddr >> PAGE_BITS;
 			struct page *pt = pfn2page(pfn);
 
-			pt_release_pml3(va(paddr), vaddr, vaddr + bytes);
+			pt_release_pml3(va(paddr), vaddr, vaddr + bytes, tlb);
 			pt->u.refcount -= pages;
 
 			if (pt->u.refcount == 0) {
 				pml4[i] = 0;
-				free_page_table(pt);
+				pt_free_table(tlb, pt, vaddr);
 			}
 		}
 		vaddr += bytes;	
 	}
 }
 
-static int pt_populate_pml4(pte_t *pml4, virt_t from, virt_t to, pte_t flags)
+static int pt_populate_pml4(pte_t *pml4, virt_t from, virt_t to, pte_t flags,
+			struct pt_bulk *bulk)
 {
 	virt_t vaddr = from;
 
@@ -300,10 +478,10 @@ static int pt_populate_pml4(pte_t *pml4, virt_t from, virt_t to, pte_t flags)
 		const pfn_t pages = bytes >> PAGE_BITS;
 
 		if (!pte_present(pml4[i])) {
-			pt = alloc_page_table(flags);
+			pt = pt_bulk_alloc(bulk);
 
 			if (!pt) {
-				pt_release_pml4(pml4, from, vaddr);
+				pt_release_pml4(pml4, from, vaddr, &bulk->tlb);
 				return -ENOMEM;
 			}
 
@@ -318,15 +496,15 @@ static int pt_populate_pml4(pte_t *pml4, virt_t from, virt_t to, pte_t flags)
 		pt->u.refcount += pages;
 
 		const int rc = pt_populate_pml3(va(paddr), vaddr, vaddr + bytes,
-					flags);
+					flags, bulk);
 
 		if (rc) {
-			pt_release_pml4(pml4, from, vaddr);
+			pt_release_pml4(pml4, from, vaddr, &bulk->tlb);
 			pt->u.refcount -= pages;
 
 			if (pt->u.refcount == 0) {
 				pml4[i] = 0;
-				free_page_table(pt);
+				pt_free_table(&bulk->tlb, pt, vaddr);
 			}
 
 			return rc;
@@ -347,7 +525,15 @@ int __pt_populate_range(pte_t *pml4, virt_t from, virt_t to, pte_t flags)
 	from = ALIGN_DOWN(linear(from), PAGE_SIZE);
 	to = ALIGN(linear(to), PAGE_SIZE);
 
-	return pt_populate_pml4(pml4, from, to, flags | PTE_PRESENT);
+	struct pt_bulk bulk;
+
+	pt_bulk_init(&bulk, pml4, from, to, flags);
+
+	const int rc = pt_populate_pml4(pml4, from, to, flags | PTE_PRESENT,
+				&bulk);
+
+	pt_bulk_release(&bulk);
+	return rc;
 }
 
 void __pt_release_range(pte_t *pml4, virt_t from, virt_t to)
@@ -358,7 +544,11 @@ void __pt_release_range(pte_t *pml4, virt_t from, virt_t to)
 	from = ALIGN_DOWN(linear(from), PAGE_SIZE);
 	to = ALIGN(linear(to), PAGE_SIZE);
 
-	pt_release_pml4(pml4, from, to);
+	struct tlb_gather tlb;
+
+	tlb_gather_init(&tlb, pt_active(pml4, from));
+	pt_release_pml4(pml4, from, to, &tlb);
+	tlb_gather_finish(&tlb);
 }
 
 static int map_range_large(pte_t *pml4, virt_t from, virt_t to, phys_t phys,
@@ -392,19 +582,41 @@ static int map_range_large(pte_t *pml4, virt_t from, virt_t to, phys_t phys,
 	return 0;
 }
 
-#define KMAP_ORDERS 16
+/**
+ * Ranges unmapped by kunmap are kept on the dirty list with their ptes
+ * and TLB entries intact, until free kmap space drops below
+ * KMAP_LOW_PAGES or an allocation fails. Then all of them are purged
+ * with a single TLB flush.
+ */
+#define KMAP_LOW_PAGES (KMAP_PAGES / 8)
+
+enum kmap_state {
+	KMAP_BUSY,
+	KMAP_FREE,
+	KMAP_DIRTY
+};
 
+/**
+ * Only the first and the last entries of a range are meaningful, and
+ * both of them keep the size of the range. Free ranges are kept in a
+ * tree ordered by address, every node knows the size of the biggest
+ * free range in its subtree.
+ */
 struct kmap_range {
-	struct list_head link;
-	pfn_t pages;
+	union {
+		struct rb_node node;
+		struct list_head link;
+	} u;
+	unsigned int pages;
+	unsigned int max_pages;
+	enum kmap_state state;
 };
 
 
 static struct kmap_range all_kmap_ranges[KMAP_PAGES];
-static struct list_head free_kmap_ranges[KMAP_ORDERS];
-
-static int kmap_order(pfn_t pages)
-{ return MIN(ilog2(pages), KMAP_ORDERS - 1); }
+static struct rb_tree free_kmap_ranges;
+static LIST_HEAD(dirty_kmap_ranges);
+static pfn_t free_kmap_pages;
 
 static struct kmap_range *virt2kmap(virt_t vaddr)
 {
@@ -420,18 +632,65 @@ static virt_t kmap2virt(struct kmap_range *range)
 	return KMAP_BASE + (page << PAGE_BITS);
 }
 
-static struct kmap_range *kmap_find_free_range(int order, pfn_t pages)
+static struct kmap_range *kmap_node(struct rb_node *node)
+{ return node ? TREE_ENTRY(node, struct kmap_range, u.node) : 0; }
+
+static unsigned int kmap_max_pages(struct rb_node *node)
+{ return node ? kmap_node(node)->max_pages : 0; }
+
+static void kmap_augment(struct rb_node *node)
 {
-	struct list_head *head = &free_kmap_ranges[order];
-	struct list_head *ptr = head->next;
+	struct kmap_range *range = kmap_node(node);
 
-	for (; ptr != head; ptr = ptr->next) {
-		struct kmap_range *range = LIST_ENTRY(ptr, struct kmap_range,
-					link);
+	range->max_pages = MAX(range->pages, MAX(kmap_max_pages(node->left),
+				kmap_max_pages(node->right)));
+}
+
+static void kmap_insert_free(struct kmap_range *range)
+{
+	struct rb_node **plink = &free_kmap_ranges.root;
+	struct rb_node *parent = 0;
+
+	while (*plink) {
+		parent = *plink;
+		if (kmap_node(parent) < range)
+			plink = &parent->right;
+		else
+			plink = &parent->left;
+	}
+
+	range->state = KMAP_FREE;
+	range->max_pages = range->pages;
+	rb_link(&range->u.node, parent, plink);
+	rb_insert_augmented(&range->u.node, &free_kmap_ranges, &kmap_augment);
+}
+
+static void kmap_erase_free(struct kmap_range *range)
+{
+	rb_erase_augmented(&range->u.node, &free_kmap_ranges, &kmap_augment);
+	range->state = KMAP_BUSY;
+}
+
+/* the free range with the lowest address that has at least pages */
+static struct kmap_range *kmap_find_free_range(pfn_t pages)
+{
+	struct rb_node *node = free_kmap_ranges.root;
+
+	if (kmap_max_pages(node) < pages)
+		return 0;
+
+	while (node) {
+		struct kmap_range *range = kmap_node(node);
 
-		if (range->pages >= pages)
+		if (kmap_max_pages(node->left) >= pages)
+			node = node->left;
+		else if (range->pages >= pages)
 			return range;
+		else
+			node = node->right;
 	}
+
+	DBG_ASSERT(0 && "Unreachable");
 	return 0;
 }
 
@@ -440,8 +699,8 @@ static void kmap_free_range(struct kmap_range *range, pfn_t pages)
 	if (range > all_kmap_ranges) {
 		struct kmap_range *prev = range - (range - 1)->pages;
 
-		if (!list_empty(&prev->link)) {
-			list_del(&prev->link);
+		if (prev->state == KMAP_FREE) {
+			kmap_erase_free(prev);
 			pages += prev->pages;
 			range = prev;
 		}
@@ -450,41 +709,138 @@ static void kmap_free_range(struct kmap_range *range, pfn_t pages)
 	if (range + pages < all_kmap_ranges + KMAP_PAGES) {
 		struct kmap_range *next = range + pages;
 
-		if (!list_empty(&next->link)) {
-			list_del(&next->link);
+		if (next->state == KMAP_FREE) {
+			kmap_erase_free(next);
 			pages += next->pages;
 		}
 	}
 
 	(range + pages - 1)->pages = range->pages = pages;
-	list_add(&range->link, free_kmap_ranges + kmap_order(pages));
+	kmap_insert_free(range);
 }
 
-static struct kmap_range *kmap_alloc_range(pfn_t pages)
+/* takes [first; first + pages) from the free range and frees the rest */
+static struct kmap_range *kmap_carve_range(struct kmap_range *range,
+			pfn_t first, pfn_t pages)
 {
-	for (int order = kmap_order(pages); order < KMAP_ORDERS; ++order) {
-		struct kmap_range *range = kmap_find_free_range(order, pages);
+	const pfn_t begin = range - all_kmap_ranges;
+	const pfn_t tail = begin + range->pages - first - pages;
+	struct kmap_range *res = all_kmap_ranges + first;
 
-		if (!range)
-			continue;
+	kmap_erase_free(range);
+	res->state = KMAP_BUSY;
+	(res + pages - 1)->pages = res->pages = pages;
+
+	if (first != begin)
+		kmap_free_range(range, first - begin);
+	if (tail)
+		kmap_free_range(res + pages, tail);
+
+	return res;
+}
+
+/* the same as kmap_alloc_range, but the range starts at align pages */
+static struct kmap_range *kmap_alloc_range_aligned(pfn_t pages, pfn_t align)
+{
+	struct kmap_range *range = kmap_find_free_range(pages + align - 1);
+
+	if (range) {
+		const pfn_t first = range - all_kmap_ranges;
+
+		return kmap_carve_range(range, ALIGN(first, align), pages);
+	}
 
-		const pfn_t range_pages = range->pages;
+	/* a smaller range still might fit if it happens to be aligned */
+	struct rb_node *node = rb_leftmost(free_kmap_ranges.root);
 
-		list_del(&range->link);
-		list_init(&range->link);
-		(range + pages - 1)->pages = range->pages = pages;
+	for (; node; node = rb_next(node)) {
+		range = kmap_node(node);
 
-		if (range_pages > pages)
-			kmap_free_range(range + pages, range_pages - pages);
+		const pfn_t first = range - all_kmap_ranges;
+		const pfn_t aligned = ALIGN(first, align);
 
-		return range;
+		if (aligned + pages <= first + range->pages)
+			return kmap_carve_range(range, aligned, pages);
 	}
 	return 0;
 }
 
+static struct kmap_range *kmap_alloc_range(pfn_t pages)
+{
+	struct kmap_range *range = kmap_find_free_range(pages);
+
+	if (!range)
+		return 0;
+
+	return kmap_carve_range(range, range - all_kmap_ranges, pages);
+}
+
+static void kmap_purge(void)
+{
+	pte_t *pt = va(load_pml4());
+	struct tlb_gather tlb;
+
+	tlb_gather_init(&tlb, true);
+	for (struct list_head *ptr = dirty_kmap_ranges.next;
+				ptr != &dirty_kmap_ranges; ptr = ptr->next) {
+		struct kmap_range *range = LIST_ENTRY(ptr, struct kmap_range,
+					u.link);
+		const virt_t from = kmap2virt(range);
+		const virt_t to = from + ((pfn_t)range->pages << PAGE_BITS);
+		struct pt_iter iter;
+
+		for_each_slot_in_range(pt, from, to, iter) {
+			const int level = iter.level;
+			const int idx = iter.idx[level];
+
+			iter.pt[level][idx] = 0;
+		}
+		tlb_gather_range(&tlb, from, to);
+	}
+	tlb_gather_finish(&tlb);
+
+	while (!list_empty(&dirty_kmap_ranges)) {
+		struct kmap_range *range = LIST_ENTRY(
+					list_first(&dirty_kmap_ranges),
+					struct kmap_range, u.link);
+
+		list_del(&range->u.link);
+		free_kmap_pages += range->pages;
+		kmap_free_range(range, range->pages);
+	}
+}
+
+static struct kmap_range *kmap_get_range(pfn_t pages, pfn_t align)
+{
+	struct kmap_range *range = align == 1
+				? kmap_alloc_range(pages)
+				: kmap_alloc_range_aligned(pages, align);
+
+	if (!range && !list_empty(&dirty_kmap_ranges)) {
+		kmap_purge();
+		range = align == 1
+				? kmap_alloc_range(pages)
+				: kmap_alloc_range_aligned(pages, align);
+	}
+
+	if (!range)
+		return 0;
+
+	free_kmap_pages -= pages;
+	if (free_kmap_pages < KMAP_LOW_PAGES)
+		kmap_purge();
+	return range;
+}
+
+static void kmap_put_range(struct kmap_range *range, pfn_t pages)
+{
+	free_kmap_pages += pages;
+	kmap_free_range(range, pages);
+}
+
 void *kmap(struct page **pages, size_t count)
 {
-	struct kmap_range *range = kmap_alloc_range(count);
+	struct kmap_range *range = kmap_get_range(count, 1);
 
 	if (!range)
 		return 0;
@@ -500,44 +856,258 @@ void *kmap(struct page **pages, size_t count)
 		const int level = iter.level;
 		const int idx = iter.idx[level];
 
+		DBG_ASSERT(!pte_present(iter.pt[level][idx]));
 		iter.pt[level][idx] = paddr | PTE_WRITE | PTE_PRESENT;
-		flush_tlb_addr(iter.addr);
 	}
+	tlb_gather_skip(count);
 
 	return (void *)from;
 }
 
+/**
+ * The mapping stays valid until purged, so the caller must not rely on
+ * access to the range faulting after kunmap.
+ */
 void kunmap(void *vaddr)
 {
 	struct kmap_range *range = virt2kmap((virt_t)vaddr);
-	const pfn_t count = range->pages;
 
-	const virt_t from = (virt_t)vaddr;
-	const virt_t to = from + (count << PAGE_BITS);
+	range->state = KMAP_DIRTY;
+	list_add_tail(&range->u.link, &dirty_kmap_ranges);
+}
+
+#define KMAP_HUGE_SLOTS (KMAP_SIZE / HUGE_PAGE_SIZE)
+#define KMAP_BATCH      16
+
+/*
+ * Large entry takes a 2MB aligned physical address, anything else sets
+ * reserved bits, so a misaligned block is given back and the caller
+ * falls back to 4K pages.
+ */
+struct page *alloc_huge_page(void)
+{
+	struct page *page = alloc_pages(HUGE_PAGE_ORDER);
+
+	if (page && (page_paddr(page) & HUGE_PAGE_MASK)) {
+		free_pages(page, HUGE_PAGE_ORDER);
+		return 0;
+	}
+	return page;
+}
+
+/* pml2 entries (pointers to pml1 tables) replaced by huge pages */
+static pte_t kmap_huge_pt[KMAP_HUGE_SLOTS];
+
+static pte_t *kmap_pml2_entry(virt_t vaddr)
+{
+	struct pt_iter iter;
+
+	pt_iter_set(&iter, va(load_pml4()), vaddr);
+	DBG_ASSERT(iter.level <= 1);
+	return &iter.pt[1][iter.idx[1]];
+}
+
+static bool kmap_map_huge(virt_t vaddr)
+{
+	struct page *page = alloc_huge_page();
+
+	if (!page)
+		return false;
+
+	pte_t *pte = kmap_pml2_entry(vaddr);
+
+	kmap_huge_pt[(vaddr - KMAP_BASE) / HUGE_PAGE_SIZE] = *pte;
+	*pte = page_paddr(page) | PTE_LARGE | PTE_WRITE | PTE_PRESENT;
+	flush_tlb_addr(vaddr);
+	return true;
+}
+
+static int kmap_map_pages(virt_t from, virt_t to)
+{
+	pte_t *pt = va(load_pml4());
+	struct page *pages[KMAP_BATCH];
+	struct pt_iter iter;
+	int count = 0, next = 0;
+
+	for_each_slot_in_range(pt, from, to, iter) {
+		const int level = iter.level;
+		const int idx = iter.idx[level];
+
+		if (next == count) {
+			const pfn_t left = (to - iter.addr) >> PAGE_BITS;
+
+			count = alloc_pages_bulk(0, MINU(left, KMAP_BATCH),
+						pages);
+			next = 0;
+			if (!count)
+				return -ENOMEM;
+		}
+
+		DBG_ASSERT(level == 0);
+		iter.pt[level][idx] = page_paddr(pages[next++]) |
+					PTE_WRITE | PTE_PRESENT;
+		tlb_gather_skip(1);
+	}
+
+	return 0;
+}
+
+static void kmap_unmap_free(virt_t from, virt_t to)
+{
 	pte_t *pt = va(load_pml4());
-	virt_t virt = from;
+	struct tlb_gather tlb;
 	struct pt_iter iter;
 
+	tlb_gather_init(&tlb, true);
 	for_each_slot_in_range(pt, from, to, iter) {
 		const int level = iter.level;
 		const int idx = iter.idx[level];
+		const pte_t pte = iter.pt[level][idx];
+
+		if (!pte_present(pte))
+			continue;
+
+		struct page *page = pfn2page(pte_phys(pte) >> PAGE_BITS);
+
+		if (level == 1) {
+			const size_t slot = (iter.addr - KMAP_BASE) /
+						HUGE_PAGE_SIZE;
+
+			/* a single invlpg drops the whole large entry */
+			iter.pt[level][idx] = kmap_huge_pt[slot];
+			tlb_gather_range(&tlb, iter.addr, iter.addr + PAGE_SIZE);
+			tlb_gather_free(&tlb, page, HUGE_PAGE_ORDER);
+			continue;
+		}
 
 		iter.pt[level][idx] = 0;
-		flush_tlb_addr(virt);
-		virt += PAGE_SIZE;
+		tlb_gather_range(&tlb, iter.addr, iter.addr + PAGE_SIZE);
+		tlb_gather_free(&tlb, page, 0);
+	}
+	tlb_gather_finish(&tlb);
+}
+
+void *kmap_alloc(size_t count)
+{
+	const pfn_t align = count >= PML1_PAGES ? PML1_PAGES : 1;
+	struct kmap_range *range = kmap_get_range(count, align);
+
+	if (!range)
+		return 0;
+
+	const virt_t from = kmap2virt(range);
+	const virt_t to = from + (count << PAGE_BITS);
+	virt_t vaddr = from;
+
+	while (vaddr != to) {
+		if (!(vaddr & HUGE_PAGE_MASK) && to - vaddr >= HUGE_PAGE_SIZE
+					&& kmap_map_huge(vaddr)) {
+			vaddr += HUGE_PAGE_SIZE;
+			continue;
+		}
+
+		/* no order 9 block or unaligned part, fallback to 4K */
+		const virt_t next = MINU(ALIGN(vaddr + 1, HUGE_PAGE_SIZE), to);
+
+		if (kmap_map_pages(vaddr, next)) {
+			kmap_unmap_free(from, next);
+			kmap_put_range(range, count);
+			return 0;
+		}
+		vaddr = next;
 	}
-	kmap_free_range(range, range->pages);
+
+	return (void *)from;
+}
+
+void kmap_free(void *ptr)
+{
+	struct kmap_range *range = virt2kmap((virt_t)ptr);
+	const pfn_t count = range->pages;
+	const virt_t from = (virt_t)ptr;
+
+	kmap_unmap_free(from, from + (count << PAGE_BITS));
+	kmap_put_range(range, count);
+}
+
+/**
+ * The first KMAP_ATOMIC_PAGES of kmap area are never given out by
+ * kmap_alloc_range, every cpu owns KMAP_ATOMIC_SLOTS of them, used as
+ * a stack, so kmap_atomic may nest (e.g. to copy a page).
+ */
+#define KMAP_ATOMIC_PAGES (KMAP_ATOMIC_SLOTS * NR_CPUS)
+
+struct kmap_atomic_cpu {
+	int top;
+	bool enabled[KMAP_ATOMIC_SLOTS];
+};
+
+static pte_t *kmap_atomic_pte[KMAP_ATOMIC_PAGES];
+static struct kmap_atomic_cpu kmap_atomic_cpu[NR_CPUS];
+
+static int kmap_atomic_slot(int cpu, int idx)
+{ return cpu * KMAP_ATOMIC_SLOTS + idx; }
+
+static virt_t kmap_atomic_addr(int slot)
+{ return KMAP_BASE + ((virt_t)slot << PAGE_BITS); }
+
+void *kmap_atomic(struct page *page)
+{
+	const bool enabled = local_preempt_save();
+	const int cpu = cpu_id();
+	struct kmap_atomic_cpu *kmap = &kmap_atomic_cpu[cpu];
+
+	DBG_ASSERT(kmap->top != KMAP_ATOMIC_SLOTS);
+
+	const int idx = kmap->top++;
+	const int slot = kmap_atomic_slot(cpu, idx);
+
+	kmap->enabled[idx] = enabled;
+	*kmap_atomic_pte[slot] = page_paddr(page) | PTE_WRITE | PTE_PRESENT;
+	return (void *)kmap_atomic_addr(slot);
+}
+
+void kunmap_atomic(void *ptr)
+{
+	const int cpu = cpu_id();
+	struct kmap_atomic_cpu *kmap = &kmap_atomic_cpu[cpu];
+	const int idx = --kmap->top;
+	const int slot = kmap_atomic_slot(cpu, idx);
+	const virt_t vaddr = kmap_atomic_addr(slot);
+
+	DBG_ASSERT((virt_t)ptr == vaddr);
+	*kmap_atomic_pte[slot] = 0;
+	flush_tlb_addr(vaddr);
+	local_preempt_restore(kmap->enabled[idx]);
 }
 
 static int setup_kmap_mapping(pte_t *pml4)
 {
-	for (int i = 0; i != KMAP_ORDERS; ++i)
-		list_init(&free_kmap_ranges[i]);
+	struct kmap_range *fixmap = all_kmap_ranges;
 
-	kmap_free_range(all_kmap_ranges, KMAP_PAGES);
+	/* looks like a busy range to kmap_free_range */
+	fixmap->state = KMAP_BUSY;
+	(fixmap + KMAP_ATOMIC_PAGES - 1)->pages = fixmap->pages =
+				KMAP_ATOMIC_PAGES;
+	kmap_free_range(fixmap + KMAP_ATOMIC_PAGES,
+				KMAP_PAGES - KMAP_ATOMIC_PAGES);
+	free_kmap_pages = KMAP_PAGES - KMAP_ATOMIC_PAGES;
 
-	return __pt_populate_range(pml4, KMAP_BASE, KMAP_BASE + KMAP_SIZE,
-				PTE_WRITE | PTE_LOW);
+	const int rc = __pt_populate_range(pml4, KMAP_BASE,
+				KMAP_BASE + KMAP_SIZE, PTE_WRITE | PTE_LOW);
+
+	if (rc)
+		return rc;
+
+	for (int slot = 0; slot != KMAP_ATOMIC_PAGES; ++slot) {
+		struct pt_iter iter;
+
+		pt_iter_set(&iter, pml4, kmap_atomic_addr(slot));
+		DBG_ASSERT(iter.level == 0);
+		kmap_atomic_pte[slot] = &iter.pt[0][iter.idx[0]];
+	}
+
+	return 0;
 }
 
 static int setup_fixed_mapping(pte_t *pml4)
@@ -15,6 +15,7 @@ typedef uint64_t pte_t;
 #define PTE_USER     ((pte_t)BIT_CONST(2))
 #define PTE_LARGE    ((pte_t)BIT_CONST(7))
 #define PTE_LOW      ((pte_t)BIT_CONST(9))
+#define PTE_COW      ((pte_t)BIT_CONST(10))
 #define PTE_FLAGS    (PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_LARGE | PTE_LOW)
 
 #define PTE_PT_FLAGS       (PTE_WRITE | PTE_USER)
@@ -34,6 +35,10 @@ typedef uint64_t pte_t;
 #define PML4_SIZE   ((virt_t)PML4_PAGES << PAGE_BITS)
 #define PML4_MASK   (PML4_SIZE - 1)
 
+#define HUGE_PAGE_ORDER 9
+#define HUGE_PAGE_SIZE  PML1_SIZE
+#define HUGE_PAGE_MASK  PML1_MASK
+
 static inline bool pte_present(pte_t pte)
 { return (pte & PTE_PRESENT) != 0; }
 
@@ -46,6 +51,9 @@ static inline bool pte_user(pte_t pte)
 static inline bool pte_large(pte_t pte)
 { return (pte & PTE_LARGE) != 0; }
 
+static inline bool pte_cow(pte_t pte)
+{ return (pte & PTE_COW) != 0; }
+
 static inline phys_t pte_phys(pte_t pte)
 { return (phys_t)(pte & (pte_t)BITS_CONST(47, 12)); }
 
@@ -96,6 +104,9 @@ static inline int pt_populate_range_large(pte_t *pml4, virt_t from, virt_t to)
 static inline void pt_release_range(pte_t *pml4, virt_t from, virt_t to)
 { __pt_release_range(pml4, from, to); }
 
+/* order HUGE_PAGE_ORDER block suitable for a large entry or 0 */
+struct page *alloc_huge_page(void);
+
 static inline void get_page(struct page *page)
 { ++page->u.refcount; }
 
@@ -128,12 +139,71 @@ static inline phys_t load_pml4(void)
 	return pml4;
 }
 
+static inline virt_t load_cr2(void)
+{
+	virt_t addr;
+
+	__asm__ volatile ("movq %%cr2, %0" : "=r"(addr));
+	return addr;
+}
+
 static inline void flush_tlb_addr(virt_t vaddr)
 { __asm__ volatile ("invlpg (%0)" : : "r"(vaddr) : "memory"); }
 
+static inline void flush_tlb_all(void)
+{ store_pml4(load_pml4()); }
+
+/**
+ * Flushes above the threshold reload CR3 instead of invlpg per page.
+ * Just setting a present bit never needs a flush, so such updates are
+ * only accounted with tlb_gather_skip.
+ */
+#define TLB_FLUSH_ALL_PAGES 32
+
+/**
+ * Gathers addresses to invalidate and pages to free after invalidation.
+ * If the page table being changed isn't active nothing is flushed, but
+ * pages are freed anyway.
+ */
+struct tlb_gather {
+	virt_t from;
+	virt_t to;
+	size_t pages;
+	bool active;
+	struct list_head free;
+};
+
+void tlb_gather_init(struct tlb_gather *tlb, bool active);
+void tlb_gather_range(struct tlb_gather *tlb, virt_t from, virt_t to);
+void tlb_gather_free(struct tlb_gather *tlb, struct page *pages, int order);
+void tlb_gather_skip(size_t pages);
+void tlb_gather_flush(struct tlb_gather *tlb);
+void tlb_gather_finish(struct tlb_gather *tlb);
+void tlb_stats(unsigned long *invlpg, unsigned long *full,
+			unsigned long *avoided);
+
 void *kmap(struct page **pages, size_t count);
 void kunmap(void *ptr);
 
+/**
+ * Maps a single page in a per-cpu slot, without any search or allocation.
+ * Preemption is disabled until the matching kunmap_atomic, mappings must
+ * be released in reverse order.
+ */
+#define KMAP_ATOMIC_SLOTS 4
+
+void *kmap_atomic(struct page *page);
+void kunmap_atomic(void *ptr);
+
+/**
+ * kmap_alloc allocates count pages and maps them contiguously, every
+ * aligned 2MB chunk is backed by a huge page if an order 9 block is
+ * available, and by 4K pages otherwise. Memory must be released with
+ * kmap_free.
+ */
+void *kmap_alloc(size_t count);
+void kmap_free(void *ptr);
+
 
 void setup_paging(void);
 
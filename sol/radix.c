@@ -0,0 +1,122 @@
+#include "kmem_cache.h"
+#include "string.h"
+#include "radix.h"
+
+#define RADIX_MAX_HEIGHT \
+	((int)((sizeof(unsigned long) * 8 + RADIX_BITS - 1) / RADIX_BITS))
+
+
+static bool radix_fits(int height, unsigned long index)
+{
+	if (height >= RADIX_MAX_HEIGHT)
+		return true;
+	return index < (1ul << (height * RADIX_BITS));
+}
+
+static struct radix_node *radix_node_create(void)
+{
+	struct radix_node *node = kmem_alloc(sizeof(*node));
+
+	if (node)
+		memset(node, 0, sizeof(*node));
+	return node;
+}
+
+static bool radix_tree_extend(struct radix_tree *tree, unsigned long index)
+{
+	if (!tree->root) {
+		while (!radix_fits(tree->height, index))
+			++tree->height;
+		return true;
+	}
+
+	while (!radix_fits(tree->height, index)) {
+		struct radix_node *node = radix_node_create();
+
+		if (!node)
+			return false;
+
+		node->slot[0] = tree->root;
+		tree->root = node;
+		++tree->height;
+	}
+	return true;
+}
+
+static struct radix_node *radix_tree_leaf(struct radix_tree *tree,
+			unsigned long index, bool create)
+{
+	if (!radix_fits(tree->height, index) || !tree->root) {
+		if (!create || !radix_tree_extend(tree, index))
+			return 0;
+		if (!tree->height)
+			tree->height = 1;
+	}
+
+	struct radix_node **pnode = &tree->root;
+
+	for (int shift = (tree->height - 1) * RADIX_BITS;; shift -= RADIX_BITS) {
+		if (!*pnode) {
+			if (!create || !(*pnode = radix_node_create()))
+				return 0;
+		}
+
+		if (!shift)
+			return *pnode;
+
+		const unsigned long i = (index >> shift) & RADIX_MASK;
+
+		pnode = (struct radix_node **)&(*pnode)->slot[i];
+	}
+}
+
+void **radix_tree_slot(struct radix_tree *tree, unsigned long index,
+			bool create)
+{
+	struct radix_node *leaf = radix_tree_leaf(tree, index, create);
+
+	if (!leaf)
+		return 0;
+	return &leaf->slot[index & RADIX_MASK];
+}
+
+void *radix_tree_lookup(struct radix_tree *tree, unsigned long index)
+{
+	void **slot = radix_tree_slot(tree, index, false);
+
+	return slot ? *slot : 0;
+}
+
+static void radix_node_destroy(struct radix_node *node, int height,
+			void (*release)(void *, void *), void *arg)
+{
+	for (unsigned long i = 0; i != RADIX_SIZE; ++i) {
+		if (!node->slot[i])
+			continue;
+
+		if (height > 1)
+			radix_node_destroy(node->slot[i], height - 1,
+						release, arg);
+		else if (release)
+			release(node->slot[i], arg);
+	}
+	kmem_free(node);
+}
+
+void radix_tree_destroy(struct radix_tree *tree,
+			void (*release)(void *, void *), void *arg)
+{
+	if (tree->root)
+		radix_node_destroy(tree->root, tree->height, release, arg);
+	radix_tree_init(tree);
+}
+
+void **radix_iter_slot(struct radix_iter *iter, bool create)
+{
+	if (!iter->leaf)
+		iter->leaf = radix_tree_leaf(iter->tree, iter->index, create);
+
+	if (!iter->leaf)
+		return 0;
+	return &iter->leaf->slot[iter->index & RADIX_MASK];
+}
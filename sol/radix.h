@@ -0,0 +1,67 @@
+#ifndef __RADIX_TREE_H__
+#define __RADIX_TREE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RADIX_BITS 6
+#define RADIX_SIZE (1ul << RADIX_BITS)
+#define RADIX_MASK (RADIX_SIZE - 1)
+
+/**
+ * Radix tree maps unsigned long indices to pointers. Every node is a
+ * dense array of RADIX_SIZE slots and a tree of height h covers
+ * indices below RADIX_SIZE^h, so dense ranges (like file pages) cost
+ * a pointer per item plus a node per RADIX_SIZE items. Nodes never
+ * move, the tree grows by pushing the root down.
+ */
+struct radix_node {
+	void *slot[RADIX_SIZE];
+};
+
+struct radix_tree {
+	struct radix_node *root;
+	int height;
+};
+
+static inline void radix_tree_init(struct radix_tree *tree)
+{
+	tree->root = 0;
+	tree->height = 0;
+}
+
+/* returns 0 if the slot doesn't exist and create is false or on ENOMEM */
+void **radix_tree_slot(struct radix_tree *tree, unsigned long index,
+			bool create);
+void *radix_tree_lookup(struct radix_tree *tree, unsigned long index);
+void radix_tree_destroy(struct radix_tree *tree,
+			void (*release)(void *item, void *arg), void *arg);
+
+/**
+ * Cursor for sequential access, it remembers the leaf node, so only
+ * every RADIX_SIZE-th step descends from the root. The tree can grow
+ * under the cursor, but must not be destroyed.
+ */
+struct radix_iter {
+	struct radix_tree *tree;
+	struct radix_node *leaf;
+	unsigned long index;
+};
+
+static inline void radix_iter_init(struct radix_iter *iter,
+			struct radix_tree *tree, unsigned long index)
+{
+	iter->tree = tree;
+	iter->leaf = 0;
+	iter->index = index;
+}
+
+static inline void radix_iter_next(struct radix_iter *iter)
+{
+	if (!(++iter->index & RADIX_MASK))
+		iter->leaf = 0;
+}
+
+void **radix_iter_slot(struct radix_iter *iter, bool create);
+
+#endif /*__RADIX_TREE_H__*/
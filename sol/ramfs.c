@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <limits.h>
 
 #include "kmem_cache.h"
 #include "kernel.h"
@@ -12,7 +13,6 @@
 
 static struct kmem_cache *ramfs_node_cache;
 static struct kmem_cache *ramfs_entry_cache;
-static struct kmem_cache *ramfs_page_cache;
 
 static struct fs_node_ops ramfs_file_node_ops;
 static struct fs_file_ops ramfs_file_ops;
@@ -232,48 +232,42 @@ static int ramfs_lookup(struct fs_node *dir, struct fs_entry *entry)
 	return 0;	
 }
 
-static struct ramfs_page *ramfs_alloc_page(size_t index)
-{
-	struct ramfs_page *rpage = kmem_cache_alloc(ramfs_page_cache);
-
-	if (!rpage)
-		return 0;
+/* a page that is going to be overwritten entirely needn't be zeroed */
+static struct page *ramfs_alloc_page(bool zero)
+{ return zero ? alloc_zeroed_pages(0) : alloc_pages(0); }
 
-	rpage->page = alloc_pages(0);
+#define RAMFS_FREE_BATCH 16
 
-	if (!rpage->page) {
-		kmem_cache_free(ramfs_page_cache, rpage);
-		return 0;
-	}
-
-	memset(page_addr(rpage->page), 0, PAGE_SIZE);
-	rpage->index = index;
-	return rpage;
-}
+/* file pages are returned to the buddy allocator in batches */
+struct ramfs_free_batch {
+	struct page *page[RAMFS_FREE_BATCH];
+	int count;
+};
 
-static void ramfs_free_page(struct ramfs_page *page)
+static void ramfs_free_batch_flush(struct ramfs_free_batch *batch)
 {
-	free_pages(page->page, 0);
-	kmem_cache_free(ramfs_page_cache, page);
+	free_pages_bulk(0, batch->count, batch->page);
+	batch->count = 0;
 }
 
-static void __ramfs_release_file_node(struct rb_node *node)
+static void ramfs_free_batch_add(void *page, void *arg)
 {
-	while (node) {
-		struct ramfs_page *page = TREE_ENTRY(node, struct ramfs_page,
-					link);
+	struct ramfs_free_batch *batch = arg;
 
-		__ramfs_release_file_node(node->right);
-		node = node->left;
-		ramfs_free_page(page);
-	}
+	if (batch->count == RAMFS_FREE_BATCH)
+		ramfs_free_batch_flush(batch);
+
+	batch->page[batch->count++] = page;
 }
 
 static void ramfs_release_file_node(struct fs_node *node)
 {
 	struct ramfs_node *rnode = RAMFS_NODE(node);
+	struct ramfs_free_batch batch;
 
-	__ramfs_release_file_node(rnode->pages.root);
+	batch.count = 0;
+	radix_tree_destroy(&rnode->pages, &ramfs_free_batch_add, &batch);
+	ramfs_free_batch_flush(&batch);
 	kmem_cache_free(ramfs_node_cache, rnode);
 }
 
@@ -297,7 +291,10 @@ static void ramfs_release_dir_node(struct fs_node *node)
 	kmem_cache_free(ramfs_node_cache, dir);
 }
 
+static int ramfs_readpage(struct fs_node *fs_node, size_t index, void *data);
+
 static struct fs_node_ops ramfs_file_node_ops = {
+	.readpage = ramfs_readpage,
 	.release = ramfs_release_file_node
 };
 
@@ -311,78 +308,48 @@ static struct fs_node_ops ramfs_dir_node_ops = {
 	.release = ramfs_release_dir_node
 };
 
-struct ramfs_page_iter {
-	struct ramfs_page *page;
-	struct rb_node *parent;
-	struct rb_node **plink;
-};
-
-static int ramfs_lookup_page(struct ramfs_node *node,
-			struct ramfs_page_iter *iter, size_t index)
-{
-	struct rb_node **plink = &node->pages.root;
-	struct rb_node *parent = 0;
-
-	while (*plink) {
-		struct ramfs_page *page = TREE_ENTRY(*plink, struct ramfs_page,
-					link);
-
-		if (page->index == index) {
-			iter->plink = plink;
-			iter->parent = parent;
-			iter->page = page;
-			return 1;
-		}
-
-		parent = *plink;
-		if (page->index < index)
-			plink = &parent->right;
-		else
-			plink = &parent->left;
-	}
-
-	iter->plink = plink;
-	iter->parent = parent;
-	iter->page = 0;
-	return 0;
-}
-
+/*
+ * Both read and write handle the whole request under one lock hold,
+ * the page index is walked with a cursor, so sequential pages cost
+ * a step through the current leaf rather than a lookup each.
+ */
 static int ramfs_write(struct fs_file *file, const char *data, size_t size)
 {
 	struct fs_node *fs_node = file->node;
 	struct ramfs_node *node = RAMFS_NODE(fs_node);
-
-	mutex_lock(&fs_node->mux);
-
-	const size_t idx = file->offset >> PAGE_BITS;
-	const size_t off = file->offset & PAGE_MASK;
-	const size_t sz = MINU(PAGE_SIZE - off, size);
-
-	struct ramfs_page_iter iter;
-	struct ramfs_page *rpage;
-
-	if (ramfs_lookup_page(node, &iter, idx)) {
-		rpage = iter.page;
-	} else {
-		rpage = ramfs_alloc_page(idx);
-		if (!rpage) {
-			mutex_unlock(&fs_node->mux);
-			return -ENOMEM;
+	struct radix_iter iter;
+	size_t pos = file->offset;
+	size_t done = 0;
+	int rc = 0;
+
+	size = MINU(size, INT_MAX - pos);
+
+	rwsem_write_lock(&fs_node->rwsem);
+	radix_iter_init(&iter, &node->pages, pos >> PAGE_BITS);
+	for (; done != size; radix_iter_next(&iter)) {
+		const size_t off = pos & PAGE_MASK;
+		const size_t sz = MINU(PAGE_SIZE - off, size - done);
+		struct page **slot = (struct page **)radix_iter_slot(&iter,
+					true);
+
+		if (slot && !*slot)
+			*slot = ramfs_alloc_page(sz != PAGE_SIZE);
+
+		if (!slot || !*slot) {
+			rc = -ENOMEM;
+			break;
 		}
 
-		rb_link(&rpage->link, iter.parent, iter.plink);
-		rb_insert(&rpage->link, &node->pages);
+		memcpy((char *)page_addr(*slot) + off, data + done, sz);
+		done += sz;
+		pos += sz;
 	}
 
-	struct page *page = rpage->page;
-	char *vaddr = page_addr(page);
-
-	memcpy(vaddr + off, data, sz);
-	file->offset += sz;
-	file->node->size = MAX(file->offset, file->node->size);
-	mutex_unlock(&fs_node->mux);
+	file->offset = pos;
+	fs_node->size = MAX(file->offset, fs_node->size);
+	rwsem_write_unlock(&fs_node->rwsem);
 
-	return (int)sz;
+	return done ? (int)done : rc;
 }
 
 static int ramfs_read(struct fs_file *file, char *data, size_t size)
@@ -390,32 +357,51 @@ static int ramfs_read(struct fs_file *file, char *data, size_t size)
 	struct fs_node *fs_node = file->node;
 	struct ramfs_node *node = RAMFS_NODE(fs_node);
 
-	mutex_lock(&fs_node->mux);
-	if (file->offset >= file->node->size) {
-		mutex_unlock(&fs_node->mux);
+	rwsem_read_lock(&fs_node->rwsem);
+	if (file->offset >= fs_node->size) {
+		rwsem_read_unlock(&fs_node->rwsem);
 		return 0;
 	}
 
-	const size_t rem = file->node->size - file->offset;
-	const size_t idx = file->offset >> PAGE_BITS;
-	const size_t off = file->offset & PAGE_MASK;
-	const size_t sz = MINU(MINU(PAGE_SIZE - off, size), rem);
+	const size_t count = MINU(size, fs_node->size - file->offset);
+	struct radix_iter iter;
+	size_t pos = file->offset;
+	size_t done = 0;
 
-	struct ramfs_page_iter iter;
+	radix_iter_init(&iter, &node->pages, pos >> PAGE_BITS);
+	for (; done != count; radix_iter_next(&iter)) {
+		const size_t off = pos & PAGE_MASK;
+		const size_t sz = MINU(PAGE_SIZE - off, count - done);
+		struct page **slot = (struct page **)radix_iter_slot(&iter,
+					false);
 
-	if (ramfs_lookup_page(node, &iter, idx)) {
-		struct page *page = iter.page->page;
-		char *vaddr = page_addr(page);
-
-		memcpy(data, vaddr + off, sz);
-	} else {
-		memset(data, 0, sz);
+		if (slot && *slot)
+			memcpy(data + done, (char *)page_addr(*slot) + off, sz);
+		else
+			memset(data + done, 0, sz);
+		done += sz;
+		pos += sz;
 	}
 
-	file->offset += sz;
-	mutex_unlock(&fs_node->mux);
+	file->offset = pos;
+	rwsem_read_unlock(&fs_node->rwsem);
 
-	return (int)sz;	
+	return (int)done;
+}
+
+static int ramfs_readpage(struct fs_node *fs_node, size_t index, void *data)
+{
+	struct ramfs_node *node = RAMFS_NODE(fs_node);
+	struct page *page;
+
+	rwsem_read_lock(&fs_node->rwsem);
+	if ((page = radix_tree_lookup(&node->pages, index)))
+		memcpy(data, page_addr(page), PAGE_SIZE);
+	else
+		memset(data, 0, PAGE_SIZE);
+	rwsem_read_unlock(&fs_node->rwsem);
+
+	return 0;
 }
 
 static int ramfs_iterate(struct fs_file *dir, struct dir_iter_ctx *ctx)
@@ -484,7 +470,6 @@ void setup_ramfs(void)
 {
 	DBG_ASSERT((ramfs_node_cache = KMEM_CACHE(struct ramfs_node)) != 0);
 	DBG_ASSERT((ramfs_entry_cache = KMEM_CACHE(struct ramfs_entry)) != 0);
-	DBG_ASSERT((ramfs_page_cache = KMEM_CACHE(struct ramfs_page)) != 0);
 	DBG_ASSERT(register_filesystem(&ramfs_type) == 0);
 
 #ifdef CONFIG_RAMFS_TEST
@@ -2,20 +2,15 @@
 #define __RAMFS_H__
 
 #include "rbtree.h"
+#include "radix.h"
 #include "vfs.h"
 
 #include <stddef.h>
 
-struct ramfs_page {
-	struct rb_node link;
-	struct page *page;
-	size_t index;
-};
-
 struct ramfs_node {
 	struct fs_node vfs_node;
 	struct rb_tree children;
-	struct rb_tree pages;
+	struct radix_tree pages; // struct page by page index
 };
 
 struct ramfs_entry {
@@ -1,13 +1,17 @@
+#include "kmem_cache.h"
 #include "string.h"
 #include "stdio.h"
 #include "error.h"
 #include "vfs.h"
+#include "mm.h"
 
 #define RAMFS_ROOT       "ramfs_smoke_test_root"
 #define RAMFS_ROOT_PATH  "/" RAMFS_ROOT
 #define RAMFS_FILE       "file"
 #define RAMFS_FILE_PATH  RAMFS_ROOT_PATH "/" RAMFS_FILE
 #define RAMFS_DIRN       10
+#define RAMFS_LARGE_OFF  100
+#define RAMFS_LARGE_SIZE (3 * PAGE_SIZE + 200)
 
 
 static void test_readdir(struct fs_file *dir)
@@ -76,6 +80,56 @@ static void test_unlink(void)
 			file_path, errstr(rc));
 }
 
+/* a repeated miss is answered by a negative entry without the fs */
+static void test_negative(void)
+{
+	const char *file_path = RAMFS_FILE_PATH;
+	unsigned long cached, fs, cached2, fs2;
+	struct fs_file file;
+	int rc;
+
+	for (int i = 0; i != 2; ++i) {
+		vfs_lookup_stats(&cached, &fs);
+		rc = vfs_open(file_path, &file);
+		vfs_lookup_stats(&cached2, &fs2);
+
+		if (rc != -ENOENT) {
+			DBG_ERR("vfs_open(%s) of a removed file returned: %s",
+				file_path, errstr(rc));
+			if (!rc)
+				vfs_release(&file);
+			return;
+		}
+	}
+
+	if (fs2 != fs || cached2 == cached)
+		DBG_ERR("repeated miss of %s reached the fs", file_path);
+	else
+		DBG_INFO("repeated miss of %s was answered from the cache",
+			file_path);
+
+	/* the negative entry must turn positive on create */
+	rc = vfs_create(file_path, &file);
+	if (rc) {
+		DBG_ERR("vfs_create(%s) after a cached miss failed: %s",
+			file_path, errstr(rc));
+		return;
+	}
+	vfs_release(&file);
+
+	rc = vfs_open(file_path, &file);
+	if (rc) {
+		DBG_ERR("vfs_open(%s) after create failed: %s",
+			file_path, errstr(rc));
+	} else {
+		DBG_INFO("vfs_open(%s) after a cached miss succeeded",
+			file_path);
+		vfs_release(&file);
+	}
+
+	test_unlink();
+}
+
 static void test_root(void)
 {
 	struct fs_file root_dir;
@@ -160,6 +214,44 @@ static void test_read_write(void)
 	}
 }
 
+static void test_mmap(void)
+{
+	const char *file_path = RAMFS_FILE_PATH;
+	const char *test_string = "ramfs test string";
+	const virt_t addr = HUGE_PAGE_SIZE;
+	struct fs_file file;
+	struct mm *mm = create_mm();
+	int rc = vfs_open(file_path, &file);
+
+	DBG_ASSERT(mm != 0);
+	if (!rc) {
+		rc = mm_map(mm, addr, addr + PAGE_SIZE, file.node, 0);
+		if (!rc)
+			rc = mm_page_fault(mm, addr, PF_USER);
+
+		if (rc) {
+			DBG_ERR("file mapping failed with error: %s",
+				errstr(rc));
+		} else {
+			struct pt_iter iter;
+
+			pt_iter_set(&iter, page_addr(mm->pt), addr);
+
+			const pte_t pte = iter.pt[0][iter.idx[0]];
+
+			if (strcmp(va(pte_phys(pte)), test_string))
+				DBG_ERR("mapped data doesn't match file data");
+			else
+				DBG_INFO("mapped data matches file data");
+		}
+		vfs_release(&file);
+	} else {
+		DBG_ERR("vfs_open(%s) failed with error: %s",
+			file_path, errstr(rc));
+	}
+	release_mm(mm);
+}
+
 static void test_read_beyond_the_end(void)
 {
 	const char *file_path = RAMFS_FILE_PATH;
@@ -198,14 +290,67 @@ static void test_read_beyond_the_end(void)
 	}
 }
 
+/* a single call has to cover all pages of the request */
+static void test_large_read_write(void)
+{
+	const char *file_path = RAMFS_FILE_PATH;
+	char *wbuf = kmem_alloc(RAMFS_LARGE_SIZE);
+	char *rbuf = kmem_alloc(RAMFS_LARGE_SIZE);
+	struct fs_file file;
+	int rc;
+
+	if (!wbuf || !rbuf) {
+		DBG_ERR("failed to allocate buffers");
+		kmem_free(wbuf);
+		kmem_free(rbuf);
+		return;
+	}
+
+	for (size_t i = 0; i != RAMFS_LARGE_SIZE; ++i)
+		wbuf[i] = (char)(i * 7 + 1);
+
+	rc = vfs_open(file_path, &file);
+	if (rc) {
+		DBG_ERR("vfs_open(%s) failed with error: %s",
+			file_path, errstr(rc));
+		kmem_free(wbuf);
+		kmem_free(rbuf);
+		return;
+	}
+
+	vfs_seek(&file, RAMFS_LARGE_OFF, FSS_SET);
+	rc = vfs_write(&file, wbuf, RAMFS_LARGE_SIZE);
+	if (rc != (int)RAMFS_LARGE_SIZE)
+		DBG_ERR("vfs_write wrote %d bytes out of %d", rc,
+			(int)RAMFS_LARGE_SIZE);
+
+	vfs_seek(&file, RAMFS_LARGE_OFF, FSS_SET);
+	memset(rbuf, 0, RAMFS_LARGE_SIZE);
+	rc = vfs_read(&file, rbuf, RAMFS_LARGE_SIZE);
+	if (rc != (int)RAMFS_LARGE_SIZE)
+		DBG_ERR("vfs_read read %d bytes out of %d", rc,
+			(int)RAMFS_LARGE_SIZE);
+	else if (memcmp(wbuf, rbuf, RAMFS_LARGE_SIZE))
+		DBG_ERR("multi-page read data doesn't match written data");
+	else
+		DBG_INFO("multi-page read data matches written data");
+
+	vfs_release(&file);
+	kmem_free(wbuf);
+	kmem_free(rbuf);
+}
+
 static void ramfs_do_test(void)
 {
 	test_create();
 	test_open();
 	test_root();
 	test_read_write();
+	test_mmap();
 	test_read_beyond_the_end();
+	test_large_read_write();
 	test_unlink();
+	test_negative();
 	test_root();
 }
 
@@ -32,4 +32,20 @@ struct rb_node *rb_prev(struct rb_node *node);
 void rb_erase(struct rb_node *node, struct rb_tree *tree);
 void rb_insert(struct rb_node *node, struct rb_tree *tree);
 
+/**
+ * Augmented tree keeps in each node a value computed from the node and
+ * its children (e.g. max over the subtree). augment recomputes the value
+ * of a single node from its children, the tree calls it for every node
+ * whose subtree changes on insert, erase or rotation.
+ * rb_augment_propagate should be called when the value of a node in
+ * the tree changes in place.
+ */
+typedef void (*rb_augment_t)(struct rb_node *node);
+
+void rb_insert_augmented(struct rb_node *node, struct rb_tree *tree,
+			rb_augment_t augment);
+void rb_erase_augmented(struct rb_node *node, struct rb_tree *tree,
+			rb_augment_t augment);
+void rb_augment_propagate(struct rb_node *node, rb_augment_t augment);
+
 #endif /*__RED_BLACK_TREE_H__*/
@@ -0,0 +1,30 @@
+#include "rcu.h"
+
+
+static LIST_HEAD(rcu_callbacks);
+
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *))
+{
+	const bool enabled = local_preempt_save();
+
+	head->func = func;
+	list_add_tail(&head->link, &rcu_callbacks);
+	local_preempt_restore(enabled);
+}
+
+void rcu_quiescent_state(void)
+{
+	LIST_HEAD(callbacks);
+	const bool enabled = local_preempt_save();
+
+	list_splice(&rcu_callbacks, &callbacks);
+	while (!list_empty(&callbacks)) {
+		struct rcu_head *head = LIST_ENTRY(list_first(&callbacks),
+					struct rcu_head, link);
+
+		list_del(&head->link);
+		head->func(head);
+	}
+	local_preempt_restore(enabled);
+}
@@ -0,0 +1,43 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include "threads_defs.h"
+#include "list.h"
+
+/**
+ * Read-side critical sections just disable preemption, so a thread
+ * that passes through schedule() can't be inside one, and every call
+ * to schedule() is a quiescent state. Callbacks queued by call_rcu
+ * before a quiescent state are invoked during it: the kernel is
+ * uniprocessor, so nobody else might still be reading. Callbacks run
+ * with preemption disabled and must not sleep.
+ */
+struct rcu_head {
+	struct list_head link;
+	void (*func)(struct rcu_head *);
+};
+
+static inline bool rcu_read_lock(void)
+{ return local_preempt_save(); }
+
+static inline void rcu_read_unlock(bool enabled)
+{ local_preempt_restore(enabled); }
+
+/* readers may traverse the list concurrently with insertion */
+static inline void list_add_rcu(struct list_head *new, struct list_head *head)
+{
+	new->next = head->next;
+	new->prev = head;
+	barrier();
+	head->next->prev = new;
+	head->next = new;
+}
+
+/* list_del keeps next of the removed entry intact for readers */
+static inline void list_del_rcu(struct list_head *entry)
+{ list_del(entry); }
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *));
+void rcu_quiescent_state(void);
+
+#endif /*__RCU_H__*/
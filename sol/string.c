@@ -1,15 +1,114 @@
 #include "string.h"
 
+#include <stdint.h>
+
+/* word sized accesses that are allowed to alias and be unaligned */
+typedef unsigned long __attribute__((__may_alias__, __aligned__(1))) word_t;
+
+#define WORD_SIZE     sizeof(unsigned long)
+#define WORD_MASK     (WORD_SIZE - 1)
+#define ONES          (~0ul / 0xff)
+
+/* below that rep movs/stos startup costs more than the word loop */
+#define REP_THRESHOLD 512
+
+bool string_erms;
+
+void setup_string(void)
+{
+	uint32_t eax = 0, ebx, ecx = 0, edx;
+
+	__asm__ volatile ("cpuid"
+		: "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+	if (eax < 7)
+		return;
+
+	eax = 7;
+	ecx = 0;
+	__asm__ volatile ("cpuid"
+		: "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+	string_erms = (ebx & (1ul << 9)) != 0;
+}
+
+static void rep_movsb(char *d, const char *s, size_t size)
+{
+	__asm__ volatile ("rep movsb"
+		: "+D"(d), "+S"(s), "+c"(size) : : "memory");
+}
+
+static void rep_movsq(char *d, const char *s, size_t size)
+{
+	size_t words = size / WORD_SIZE;
+
+	__asm__ volatile ("rep movsq"
+		: "+D"(d), "+S"(s), "+c"(words) : : "memory");
+	size &= WORD_MASK;
+	while (size--)
+		*d++ = *s++;
+}
+
+static void rep_stosb(char *d, unsigned char value, size_t size)
+{
+	__asm__ volatile ("rep stosb"
+		: "+D"(d), "+c"(size) : "a"(value) : "memory");
+}
+
+static void rep_stosq(char *d, unsigned long value, size_t size)
+{
+	size_t words = size / WORD_SIZE;
+
+	__asm__ volatile ("rep stosq"
+		: "+D"(d), "+c"(words) : "a"(value) : "memory");
+	size &= WORD_MASK;
+	while (size--)
+		*d++ = (char)value;
+}
+
 void *memcpy(void *dst, const void *src, size_t size)
 {
 	char *d = dst;
 	const char *s = src;
 
+	if (size >= REP_THRESHOLD) {
+		if (string_erms)
+			rep_movsb(d, s, size);
+		else
+			rep_movsq(d, s, size);
+		return dst;
+	}
+
+	/* align stores, loads might stay unaligned */
+	while (size && ((uintptr_t)d & WORD_MASK)) {
+		*d++ = *s++;
+		--size;
+	}
+
+	for (; size >= 4 * WORD_SIZE; size -= 4 * WORD_SIZE) {
+		const unsigned long w0 = ((const word_t *)s)[0];
+		const unsigned long w1 = ((const word_t *)s)[1];
+		const unsigned long w2 = ((const word_t *)s)[2];
+		const unsigned long w3 = ((const word_t *)s)[3];
+
+		((word_t *)d)[0] = w0;
+		((word_t *)d)[1] = w1;
+		((word_t *)d)[2] = w2;
+		((word_t *)d)[3] = w3;
+		d += 4 * WORD_SIZE;
+		s += 4 * WORD_SIZE;
+	}
+
+	for (; size >= WORD_SIZE; size -= WORD_SIZE) {
+		*(word_t *)d = *(const word_t *)s;
+		d += WORD_SIZE;
+		s += WORD_SIZE;
+	}
+
 	while (size--)
 		*d++ = *s++;
 	return dst;
 }
 
+/* backward copy with DF set is slow everywhere, so only words here */
 static void *memcpy_r(void *dst, const void *src, size_t size)
 {
 	char *d = dst;
@@ -17,27 +116,71 @@ static void *memcpy_r(void *dst, const void *src, size_t size)
 
 	d += size;
 	s += size;
+	while (size && ((uintptr_t)d & WORD_MASK)) {
+		*(--d) = *(--s);
+		--size;
+	}
+
+	for (; size >= WORD_SIZE; size -= WORD_SIZE) {
+		d -= WORD_SIZE;
+		s -= WORD_SIZE;
+		*(word_t *)d = *(const word_t *)s;
+	}
+
 	while (size--)
 		*(--d) = *(--s);
 	return dst;
 }
 
 void *memmove(void *dst, const void *src, size_t size)
-{ return dst > src ? memcpy_r(dst, src, size) : memcpy(dst, src, size); }
+{
+	const char *d = dst;
+	const char *s = src;
+
+	if (d <= s || d >= s + size)
+		return memcpy(dst, src, size);
+	return memcpy_r(dst, src, size);
+}
 
 void *memset(void *dst, int value, size_t size)
 {
-	char *ptr = dst;
+	const unsigned long word = ONES * (unsigned char)value;
+	char *d = dst;
+
+	if (size >= REP_THRESHOLD) {
+		if (string_erms)
+			rep_stosb(d, (unsigned char)value, size);
+		else
+			rep_stosq(d, word, size);
+		return dst;
+	}
+
+	while (size && ((uintptr_t)d & WORD_MASK)) {
+		*d++ = value;
+		--size;
+	}
+
+	for (; size >= WORD_SIZE; size -= WORD_SIZE) {
+		*(word_t *)d = word;
+		d += WORD_SIZE;
+	}
 
 	while (size--)
-		*ptr++ = value;
+		*d++ = value;
 	return dst;
 }
 
 int memcmp(const void *lptr, const void *rptr, size_t size)
 {
-	const char *l = lptr;
-	const char *r = rptr;
+	const unsigned char *l = lptr;
+	const unsigned char *r = rptr;
+
+	/* skip equal words, the difference is looked for bytewise */
+	while (size >= WORD_SIZE && *(const word_t *)l == *(const word_t *)r) {
+		l += WORD_SIZE;
+		r += WORD_SIZE;
+		size -= WORD_SIZE;
+	}
 
 	while (size && *l == *r) {
 		++l;
@@ -48,23 +191,85 @@ int memcmp(const void *lptr, const void *rptr, size_t size)
 	return size ? *l - *r : 0;
 }
 
+/*
+ * SWAR helpers: zero_bytes has the high bit set in the lowest byte of w
+ * that is zero (bits above it might be false positives, so only the
+ * lowest one can be trusted). Strings are read by aligned words, so
+ * reads never cross a page boundary beyond the terminator.
+ */
+#define HIGHS (ONES << 7)
+
+static unsigned long zero_bytes(unsigned long w)
+{ return (w - ONES) & ~w & HIGHS; }
+
+static unsigned long byte_bytes(unsigned long w, unsigned char c)
+{ return zero_bytes(w ^ (ONES * c)); }
+
+static size_t first_byte(unsigned long mask)
+{ return __builtin_ctzl(mask) / 8; }
+
+/* aligned word containing str, bytes before str replaced with fill */
+static unsigned long first_word(const char *str, unsigned char fill)
+{
+	const size_t off = (uintptr_t)str & WORD_MASK;
+	const word_t *ptr = (const word_t *)(str - off);
+	const unsigned long before = off ? ~0ul >> (8 * (WORD_SIZE - off)) : 0;
+
+	return (*ptr & ~before) | (ONES * fill & before);
+}
+
 size_t strlen(const char *str)
 {
-	const char *pos = str;
+	const word_t *ptr = (const word_t *)((uintptr_t)str & ~WORD_MASK);
+	unsigned long mask = zero_bytes(first_word(str, 0xff));
+
+	while (!mask)
+		mask = zero_bytes(*++ptr);
+
+	return (const char *)ptr + first_byte(mask) - str;
+}
+
+char *strchrnul(const char *str, int c)
+{
+	const word_t *ptr = (const word_t *)((uintptr_t)str & ~WORD_MASK);
+	/* bytes before str must match neither c nor the terminator */
+	unsigned long w = first_word(str, (unsigned char)c == 0xff ? 1 : 0xff);
+	unsigned long mask;
 
-	while (*pos) ++pos;
-	return pos - str;
+	while (!(mask = zero_bytes(w) | byte_bytes(w, c)))
+		w = *++ptr;
+
+	return (char *)ptr + first_byte(mask);
 }
 
 char *strchr(const char *str, int c)
 {
-	while (*str && *str != c)
-		++str;
-	return *str ? (char *)str : 0;
+	char *pos = strchrnul(str, c);
+
+	return *pos == (char)c ? pos : 0;
 }
 
-int strcmp(const char *l, const char *r)
+int strcmp(const char *lptr, const char *rptr)
 {
+	const unsigned char *l = (const unsigned char *)lptr;
+	const unsigned char *r = (const unsigned char *)rptr;
+
+	/* words only if both strings reach alignment at the same time */
+	if (!(((uintptr_t)l ^ (uintptr_t)r) & WORD_MASK)) {
+		while ((uintptr_t)l & WORD_MASK) {
+			if (*l != *r || !*l)
+				return *l - *r;
+			++l;
+			++r;
+		}
+
+		while (*(const word_t *)l == *(const word_t *)r
+				&& !zero_bytes(*(const word_t *)l)) {
+			l += WORD_SIZE;
+			r += WORD_SIZE;
+		}
+	}
+
 	while (*l == *r && *l) {
 		++l;
 		++r;
@@ -82,11 +287,4 @@ char *strncpy(char *dst, const char *src, size_t size)
 }
 
 char *strcpy(char *dst, const char *src)
-{
-	char *ret = dst;
-
-	while (*src)
-		*dst++ = *src++;
-	*dst = 0;
-	return ret;
-}
+{ return memcpy(dst, src, strlen(src) + 1); }
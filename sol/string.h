@@ -1,16 +1,24 @@
 #ifndef __STRING_H__
 #define __STRING_H__
 
+#include <stdbool.h>
 #include <stddef.h>
 
+/* large copies and fills use rep movsb/stosb, set by setup_string */
+extern bool string_erms;
+
 void *memcpy(void *dst, const void *src, size_t size);
 void *memmove(void *dst, const void *src, size_t size);
 void *memset(void *dst, int value, size_t size);
 int memcmp(const void *l, const void *r, size_t size);
 size_t strlen(const char *str);
 char *strchr(const char *str, int c);
+/* the same as strchr, but returns the terminator if there is no c */
+char *strchrnul(const char *str, int c);
 int strcmp(const char *l, const char *r);
 char *strncpy(char *dst, const char *src, size_t size);
 char *strcpy(char *dst, const char *src);
 
+void setup_string(void);
+
 #endif /*__STRING_H__*/
@@ -0,0 +1,308 @@
+/*
+ * Host-side benchmark of the kernel memcpy/memset/memmove/memcmp and
+ * strlen/strcmp/strchr against the old byte loops and the host libc. Build with
+ * "make string_bench". The kernel string.c is compiled in under other
+ * names, with the same flags that matter for the kernel (no SSE).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void *(*const libc_memcpy)(void *, const void *, size_t) = memcpy;
+static void *(*const libc_memmove)(void *, const void *, size_t) = memmove;
+static void *(*const libc_memset)(void *, int, size_t) = memset;
+static int (*const libc_memcmp)(const void *, const void *, size_t) = memcmp;
+static size_t (*const libc_strlen)(const char *) = strlen;
+static int (*const libc_strcmp)(const char *, const char *) = strcmp;
+static char *(*const libc_strchr)(const char *, int) = strchr;
+
+#define memcpy sol_memcpy
+#define memmove sol_memmove
+#define memset sol_memset
+#define memcmp sol_memcmp
+#define strlen sol_strlen
+#define strchr sol_strchr
+#define strchrnul sol_strchrnul
+#define strcmp sol_strcmp
+#define strncpy sol_strncpy
+#define strcpy sol_strcpy
+#include "string.c"
+
+#define BENCH_MIN_SIZE 8
+#define BENCH_MAX_SIZE (64 * 1024)
+#define BENCH_BYTES    (64ul << 20) // per size and variant
+
+
+enum bench_variant {
+	BV_BYTE,
+	BV_WORD,
+	BV_ERMS,
+	BV_LIBC,
+	BV_COUNT
+};
+
+static const char *variant_name[BV_COUNT] = {
+	"byte", "word", "erms", "libc"
+};
+
+enum bench_op {
+	BO_MEMCPY,
+	BO_MEMMOVE,
+	BO_MEMSET,
+	BO_MEMCMP,
+	BO_STRLEN,
+	BO_STRCMP,
+	BO_STRCHR,
+	BO_COUNT
+};
+
+static const char *op_name[BO_COUNT] = {
+	"memcpy", "memmove", "memset", "memcmp", "strlen", "strcmp", "strchr"
+};
+
+static char src_buf[BENCH_MAX_SIZE + 64];
+static char dst_buf[BENCH_MAX_SIZE + 64];
+static char str_buf[2][BENCH_MAX_SIZE + 64];
+static volatile int sink;
+
+
+/* the old implementation */
+static __attribute__((noinline)) void byte_memcpy(void *dst, const void *src,
+			size_t size)
+{
+	char *d = dst;
+	const char *s = src;
+
+	while (size--)
+		*d++ = *s++;
+}
+
+static __attribute__((noinline)) void byte_memset(void *dst, int value,
+			size_t size)
+{
+	char *d = dst;
+
+	while (size--)
+		*d++ = value;
+}
+
+static __attribute__((noinline)) int byte_memcmp(const void *lptr,
+			const void *rptr, size_t size)
+{
+	const char *l = lptr;
+	const char *r = rptr;
+
+	while (size && *l == *r) {
+		++l;
+		++r;
+		--size;
+	}
+	return size ? *l - *r : 0;
+}
+
+static __attribute__((noinline)) size_t byte_strlen(const char *str)
+{
+	const char *pos = str;
+
+	while (*pos) ++pos;
+	return pos - str;
+}
+
+static __attribute__((noinline)) int byte_strcmp(const char *l, const char *r)
+{
+	while (*l == *r && *l) {
+		++l;
+		++r;
+	}
+	return *l - *r;
+}
+
+static __attribute__((noinline)) char *byte_strchr(const char *str, int c)
+{
+	while (*str && *str != c)
+		++str;
+	return *str ? (char *)str : 0;
+}
+
+static void bench_once(enum bench_op op, enum bench_variant v, size_t size)
+{
+	/* dst is misaligned on purpose, memmove overlaps forward */
+	char *dst = dst_buf + 3;
+	char *src = src_buf;
+
+	switch (op) {
+	case BO_MEMCPY:
+		if (v == BV_BYTE)
+			byte_memcpy(dst, src, size);
+		else if (v == BV_LIBC)
+			libc_memcpy(dst, src, size);
+		else
+			sol_memcpy(dst, src, size);
+		break;
+	case BO_MEMMOVE:
+		if (v == BV_BYTE)
+			byte_memcpy(dst, dst + 1, size);
+		else if (v == BV_LIBC)
+			libc_memmove(dst + 1, dst, size);
+		else
+			sol_memmove(dst + 1, dst, size);
+		break;
+	case BO_MEMSET:
+		if (v == BV_BYTE)
+			byte_memset(dst, 0, size);
+		else if (v == BV_LIBC)
+			libc_memset(dst, 0, size);
+		else
+			sol_memset(dst, 0, size);
+		break;
+	case BO_MEMCMP:
+		if (v == BV_BYTE)
+			sink = byte_memcmp(src, src + 32, size);
+		else if (v == BV_LIBC)
+			sink = libc_memcmp(src, src + 32, size);
+		else
+			sink = sol_memcmp(src, src + 32, size);
+		break;
+	case BO_STRLEN:
+		if (v == BV_BYTE)
+			sink = byte_strlen(str_buf[0]);
+		else if (v == BV_LIBC)
+			sink = libc_strlen(str_buf[0]);
+		else
+			sink = sol_strlen(str_buf[0]);
+		break;
+	case BO_STRCMP:
+		if (v == BV_BYTE)
+			sink = byte_strcmp(str_buf[0], str_buf[1]);
+		else if (v == BV_LIBC)
+			sink = libc_strcmp(str_buf[0], str_buf[1]);
+		else
+			sink = sol_strcmp(str_buf[0], str_buf[1]);
+		break;
+	case BO_STRCHR:
+		if (v == BV_BYTE)
+			sink = byte_strchr(str_buf[0], '/') != 0;
+		else if (v == BV_LIBC)
+			sink = libc_strchr(str_buf[0], '/') != 0;
+		else
+			sink = sol_strchr(str_buf[0], '/') != 0;
+		break;
+	default:
+		break;
+	}
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* returns throughput in MB/s */
+static unsigned long long bench(enum bench_op op, enum bench_variant v,
+			size_t size)
+{
+	const unsigned long iters = BENCH_BYTES / size;
+
+	string_erms = v == BV_ERMS;
+	bench_once(op, v, size);
+
+	const unsigned long long begin = now_ns();
+
+	for (unsigned long i = 0; i != iters; ++i)
+		bench_once(op, v, size);
+
+	const unsigned long long ns = now_ns() - begin;
+
+	return ns ? (unsigned long long)iters * size * 1000 / ns : 0;
+}
+
+static int check(void)
+{
+	for (size_t size = 0; size != 300; ++size) {
+		for (size_t off = 0; off != 8; ++off) {
+			for (size_t i = 0; i != sizeof(src_buf); ++i)
+				src_buf[i] = (char)(i * 7 + 1);
+
+			sol_memcpy(dst_buf + off, src_buf + 1, size);
+			if (libc_memcmp(dst_buf + off, src_buf + 1, size))
+				return -1;
+
+			sol_memmove(src_buf + off, src_buf, size);
+			sol_memmove(src_buf, src_buf + off, size);
+			sol_memset(dst_buf + off, 0xab, size);
+			for (size_t i = 0; i != size; ++i)
+				if ((unsigned char)dst_buf[off + i] != 0xab)
+					return -1;
+
+			sol_memcpy(dst_buf, src_buf, size + off);
+			if (size)
+				dst_buf[off + size - 1] ^= 1;
+			if ((sol_memcmp(dst_buf, src_buf, size + off) < 0) !=
+				(libc_memcmp(dst_buf, src_buf, size + off) < 0))
+				return -1;
+
+			char *str = str_buf[0] + off;
+			char *other = str_buf[1] + (size & 7);
+
+			libc_memset(str_buf, 'a', sizeof(str_buf));
+			str[size] = '\0';
+			other[size] = '\0';
+			if (sol_strlen(str) != size)
+				return -1;
+			if (sol_strchr(str, 'b') || sol_strchr(str, 0) != str + size)
+				return -1;
+			if (size && sol_strchr(str, 'a') != str)
+				return -1;
+			if (sol_strcmp(str, other))
+				return -1;
+			if (size) {
+				str[size - 1] = 'b';
+				if (sol_strchr(str, 'b') != str + size - 1)
+					return -1;
+				if (sol_strcmp(str, other) <= 0)
+					return -1;
+				if (sol_strcmp(other, str) >= 0)
+					return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int main(void)
+{
+	const bool erms = (setup_string(), string_erms);
+
+	if (check()) {
+		puts("string.c produced wrong results");
+		return 1;
+	}
+
+	for (size_t i = 0; i != sizeof(src_buf); ++i)
+		src_buf[i] = (char)(i & 31);
+	libc_memset(str_buf, 'a', sizeof(str_buf));
+
+	printf("ERMS %s, throughput in MB/s\n", erms ? "supported" : "absent");
+	for (int op = 0; op != BO_COUNT; ++op) {
+		printf("\n%-8s %8s", op_name[op], "size");
+		for (int v = 0; v != BV_COUNT; ++v)
+			printf(" %8s", variant_name[v]);
+		puts("");
+
+		for (size_t size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE;
+					size *= 2) {
+			str_buf[0][size] = str_buf[1][size] = '\0';
+			printf("%-8s %8zu", "", size);
+			for (int v = 0; v != BV_COUNT; ++v)
+				printf(" %8llu", bench(op, v, size));
+			puts("");
+			str_buf[0][size] = str_buf[1][size] = 'a';
+		}
+	}
+
+	return 0;
+}
@@ -7,6 +7,7 @@
 #include "error.h"
 #include "stdio.h"
 #include "time.h"
+#include "rcu.h"
 #include "mm.h"
 
 #include <stdint.h>
@@ -76,7 +77,12 @@ static void check_stack(struct thread *thread)
 }
 
 void idle(void)
-{ while (1) schedule(); }
+{
+	while (1) {
+		refill_zeroed_pages();
+		schedule();
+	}
+}
 
 static void preempt_thread(struct thread *thread)
 {
@@ -229,6 +235,8 @@ static struct thread *alloc_thread(void)
 
 	spinlock_init(&thread->lock);
 	thread->refcount = 1; // one for wait
+	thread->home_node = current()->home_node;
+	thread->policy = current()->policy;
 	thread->stack = stack;
 	thread->state = THREAD_BLOCKED;
 	thread->pid = -1;
@@ -412,6 +420,9 @@ static struct thread *next_thread(void)
 
 void schedule(void)
 {
+	/* nobody who calls schedule is inside rcu_read_lock section */
+	rcu_quiescent_state();
+
 	const bool enabled = local_preempt_save();
 	struct thread *thread = next_thread();
 
@@ -451,7 +462,10 @@ void setup_threading(void)
 	static struct mm mm;
 
 	bootstrap.state = THREAD_ACTIVE;
+	bootstrap.home_node = MEMORY_NODE_NONE;
+	bootstrap.policy.mode = MPOL_LOCAL;
 	bootstrap.mm = &mm;
 	mm.pt = pfn2page(load_pml4() >> PAGE_BITS);
+	list_init(&mm.vmas);
 	current_thread = &bootstrap;
 }
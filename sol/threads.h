@@ -6,6 +6,7 @@
 
 #include "locking.h"
 #include "kernel.h"
+#include "memory.h"
 #include "rbtree.h"
 
 
@@ -30,6 +31,9 @@ struct thread {
 	struct mm *mm;
 	struct spinlock lock;
 	int refcount;
+
+	int home_node;
+	struct mempolicy policy;
 };
 
 struct scheduler {
@@ -5,6 +5,14 @@
 
 extern unsigned long long jiffies;
 
+static inline unsigned long long rdtsc(void)
+{
+	unsigned long lo, hi;
+
+	__asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return (unsigned long long)hi << 32 | lo;
+}
+
 void setup_time(void);
 
 #endif /*__TIME_H__*/
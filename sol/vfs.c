@@ -1,10 +1,30 @@
 #include "kmem_cache.h"
+#include "memory.h"
 #include "kernel.h"
 #include "string.h"
 #include "error.h"
 #include "vfs.h"
 
+#include <stdint.h>
 
+#define FS_ENTRY_HASH_BITS 12
+#define FS_ENTRY_HASH_SIZE (1ul << FS_ENTRY_HASH_BITS)
+#define FS_ENTRY_LRU_MAX   4096 // unused entries kept without memory pressure
+
+
+struct fs_entry_bucket {
+	struct list_head entries;
+	struct spinlock lock;
+};
+
+static struct fs_entry_bucket fs_entry_hash[FS_ENTRY_HASH_SIZE];
+static LIST_HEAD(fs_entry_lru);
+static DEFINE_SPINLOCK(fs_entry_lru_lock);
+static unsigned long fs_entry_unused;
+static unsigned long fs_walk_rcu;
+static unsigned long fs_walk_ref;
+static unsigned long fs_lookup_cached;
+static unsigned long fs_lookup_fs;
 static struct kmem_cache *fs_entry_cache;
 static struct fs_entry fs_root_entry;
 static struct fs_node fs_root_node;
@@ -13,7 +33,28 @@ static LIST_HEAD(fs_mounts);
 static LIST_HEAD(fs_types);
 
 
-static struct fs_entry *vfs_entry_create(const char *name)
+/* FNV-1a, names are short, so a byte at a time is fine here */
+static unsigned long vfs_name_hash(const char *name)
+{
+	unsigned long hash = 0xcbf29ce484222325ul;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x100000001b3ul;
+	}
+	return hash;
+}
+
+static struct fs_entry_bucket *vfs_entry_bucket(const struct fs_entry *dir,
+			unsigned long hash)
+{
+	const unsigned long key = hash ^ (uintptr_t)dir;
+
+	return &fs_entry_hash[(key * 0x9e3779b97f4a7c15ul)
+				>> (64 - FS_ENTRY_HASH_BITS)];
+}
+
+static struct fs_entry *vfs_entry_create(const char *name, unsigned long hash)
 {
 	struct fs_entry *entry = kmem_cache_alloc(fs_entry_cache);
 
@@ -21,126 +62,406 @@ static struct fs_entry *vfs_entry_create(const char *name)
 		return 0;
 
 	memset(entry, 0, sizeof(*entry));
+	list_init(&entry->lru);
 	spinlock_init(&entry->lock);
 	strcpy(entry->name, name);
+	entry->hash = hash;
 	entry->refcount = 1;
 	return entry;
 }
 
-static void __vfs_entry_detach(struct fs_entry *entry, struct fs_entry *dir)
+static void vfs_entry_free(struct rcu_head *head)
+{
+	struct fs_entry *entry = LIST_ENTRY(head, struct fs_entry, rcu);
+
+	kmem_cache_free(fs_entry_cache, entry);
+}
+
+/* must be called with the bucket lock held */
+static struct fs_entry *__vfs_entry_find(struct fs_entry_bucket *bucket,
+			const struct fs_entry *dir, const char *name,
+			unsigned long hash)
+{
+	for (struct list_head *ptr = bucket->entries.next;
+				ptr != &bucket->entries; ptr = ptr->next) {
+		struct fs_entry *entry = LIST_ENTRY(ptr, struct fs_entry, link);
+
+		if (entry->parent != dir || entry->hash != hash)
+			continue;
+
+		if (!strcmp(entry->name, name))
+			return entry;
+	}
+	return 0;
+}
+
+/* must be called with both the hash bucket and the entry locks held */
+static void __vfs_entry_detach(struct fs_entry *entry)
 {
 	if (entry->cached) {
-		rb_erase(&entry->link, &dir->children);
+		list_del_rcu(&entry->link);
 		entry->cached = false;
 	}
 }
 
-void vfs_entry_detach(struct fs_entry *entry)
+/* LRU helpers must be called with the entry lock held */
+static void vfs_entry_lru_add(struct fs_entry *entry)
 {
-	struct fs_entry *parent = entry->parent;
-	const bool enabled = spin_lock_irqsave(&parent->lock);
-	__vfs_entry_detach(entry, parent);
-	spin_unlock_irqrestore(&parent->lock, enabled);
+	const bool enabled = spin_lock_irqsave(&fs_entry_lru_lock);
+
+	list_add(&entry->lru, &fs_entry_lru);
+	++fs_entry_unused;
+	spin_unlock_irqrestore(&fs_entry_lru_lock, enabled);
+}
+
+static void vfs_entry_lru_del(struct fs_entry *entry)
+{
+	const bool enabled = spin_lock_irqsave(&fs_entry_lru_lock);
+
+	if (!list_empty(&entry->lru)) {
+		list_del(&entry->lru);
+		list_init(&entry->lru);
+		--fs_entry_unused;
+	}
+	spin_unlock_irqrestore(&fs_entry_lru_lock, enabled);
 }
 
 struct fs_entry *vfs_entry_get(struct fs_entry *entry)
 {
 	if (entry) {	
 		const bool enabled = spin_lock_irqsave(&entry->lock);
-		++entry->refcount;
+
+		if (!entry->refcount++)
+			vfs_entry_lru_del(entry);
 		spin_unlock_irqrestore(&entry->lock, enabled);
 	}
 	return entry;
 }
 
-void vfs_entry_put(struct fs_entry *entry)
+/* entries found without locks might be on their way out */
+static bool vfs_entry_tryget(struct fs_entry *entry)
 {
-	struct fs_entry *dir = entry->parent;
+	const bool enabled = spin_lock_irqsave(&entry->lock);
+	const bool alive = entry->cached;
+
+	if (alive && !entry->refcount++)
+		vfs_entry_lru_del(entry);
+	spin_unlock_irqrestore(&entry->lock, enabled);
+	return alive;
+}
+
+/* the entry must be detached and unused */
+static void vfs_entry_destroy(struct fs_entry *entry)
+{
+	vfs_entry_put(entry->parent);
+	vfs_node_put(entry->node);
+	call_rcu(&entry->rcu, &vfs_entry_free);
+}
+
+/*
+ * Frees up to count unused entries starting from the least recently
+ * used one. An entry might be revived by a lookup after it has been
+ * taken off the LRU list, so it's checked again under the locks.
+ */
+static unsigned long vfs_entry_evict(unsigned long count)
+{
+	unsigned long freed = 0;
+
+	while (freed != count) {
+		const bool enabled = rcu_read_lock();
+		bool locked = spin_lock_irqsave(&fs_entry_lru_lock);
+
+		if (list_empty(&fs_entry_lru)) {
+			spin_unlock_irqrestore(&fs_entry_lru_lock, locked);
+			rcu_read_unlock(enabled);
+			break;
+		}
+
+		struct fs_entry *entry = LIST_ENTRY(fs_entry_lru.prev,
+					struct fs_entry, lru);
+
+		list_del(&entry->lru);
+		list_init(&entry->lru);
+		--fs_entry_unused;
+		spin_unlock_irqrestore(&fs_entry_lru_lock, locked);
+
+		struct fs_entry_bucket *bucket = vfs_entry_bucket(
+					entry->parent, entry->hash);
+
+		locked = spin_lock_irqsave(&bucket->lock);
+
+		const bool entry_locked = spin_lock_irqsave(&entry->lock);
+		const bool unused = !entry->refcount && entry->cached &&
+					list_empty(&entry->lru);
+
+		if (unused)
+			__vfs_entry_detach(entry);
+		spin_unlock_irqrestore(&entry->lock, entry_locked);
+		spin_unlock_irqrestore(&bucket->lock, locked);
+		rcu_read_unlock(enabled);
+
+		if (unused) {
+			vfs_entry_destroy(entry);
+			++freed;
+		}
+	}
+	return freed;
+}
+
+static unsigned long vfs_entry_shrink(struct shrinker *shrinker,
+			unsigned long count)
+{
+	(void) shrinker;
+
+	return vfs_entry_evict(count);
+}
+
+static struct shrinker fs_entry_shrinker = {
+	.scan = &vfs_entry_shrink
+};
 
+void vfs_entry_put(struct fs_entry *entry)
+{
 	const bool enabled = spin_lock_irqsave(&entry->lock);
 	const int refcount = --entry->refcount;
+	const bool cached = entry->cached;
+
+	if (!refcount && cached)
+		vfs_entry_lru_add(entry);
 	spin_unlock_irqrestore(&entry->lock, enabled);
 
 	if (refcount != 0)
 		return;
 
-	spin_lock(&dir->lock);
-	spin_lock(&entry->lock);
-
-	if (entry->refcount) {
-		spin_unlock_irqrestore(&entry->lock, false);
-		spin_unlock_irqrestore(&dir->lock, enabled);
+	if (!cached) {
+		vfs_entry_destroy(entry);
 		return;
 	}
-	__vfs_entry_detach(entry, dir);
 
-	spin_unlock_irqrestore(&entry->lock, false);
-	spin_unlock_irqrestore(&dir->lock, enabled);
+	if (fs_entry_unused > FS_ENTRY_LRU_MAX)
+		vfs_entry_evict(fs_entry_unused - FS_ENTRY_LRU_MAX);
+}
 
-	vfs_entry_put(entry->parent);
-	vfs_node_put(entry->node);
-	kmem_cache_free(fs_entry_cache, entry);
+/*
+ * Must be called with the hash bucket lock held. Returns true if the
+ * entry was cached and unused, then nobody else can reach it and the
+ * caller must destroy it.
+ */
+static bool __vfs_entry_unhash(struct fs_entry *entry)
+{
+	const bool enabled = spin_lock_irqsave(&entry->lock);
+	const bool unused = entry->cached && !entry->refcount;
+
+	__vfs_entry_detach(entry);
+	if (unused)
+		vfs_entry_lru_del(entry);
+	spin_unlock_irqrestore(&entry->lock, enabled);
+	return unused;
+}
+
+void vfs_entry_detach(struct fs_entry *entry)
+{
+	struct fs_entry_bucket *bucket = vfs_entry_bucket(entry->parent,
+				entry->hash);
+	const bool enabled = spin_lock_irqsave(&bucket->lock);
+	const bool unused = __vfs_entry_unhash(entry);
+
+	spin_unlock_irqrestore(&bucket->lock, enabled);
+
+	if (unused)
+		vfs_entry_destroy(entry);
+}
+
+/* drops the cached entry for the name, so the next lookup asks the fs */
+static void vfs_entry_invalidate(struct fs_entry *dir, const char *name)
+{
+	const unsigned long hash = vfs_name_hash(name);
+	struct fs_entry_bucket *bucket = vfs_entry_bucket(dir, hash);
+	const bool enabled = spin_lock_irqsave(&bucket->lock);
+	struct fs_entry *entry = __vfs_entry_find(bucket, dir, name, hash);
+	const bool unused = entry && __vfs_entry_unhash(entry);
+
+	spin_unlock_irqrestore(&bucket->lock, enabled);
+
+	if (unused)
+		vfs_entry_destroy(entry);
+}
+
+static bool vfs_entry_under(const struct fs_entry *entry,
+			const struct fs_entry *dir)
+{
+	for (; entry != &fs_root_entry; entry = entry->parent) {
+		if (entry == dir)
+			return true;
+	}
+	return false;
+}
+
+/* returns the first unused entry under dir in the bucket, unhashed */
+static struct fs_entry *vfs_entry_unhash_unused(struct fs_entry_bucket *bucket,
+			const struct fs_entry *dir)
+{
+	const bool enabled = spin_lock_irqsave(&bucket->lock);
+	struct fs_entry *found = 0;
+
+	for (struct list_head *ptr = bucket->entries.next;
+				ptr != &bucket->entries; ptr = ptr->next) {
+		struct fs_entry *entry = LIST_ENTRY(ptr, struct fs_entry, link);
+
+		if (!vfs_entry_under(entry, dir))
+			continue;
+
+		const bool locked = spin_lock_irqsave(&entry->lock);
+
+		if (!entry->refcount) {
+			__vfs_entry_detach(entry);
+			vfs_entry_lru_del(entry);
+			found = entry;
+		}
+		spin_unlock_irqrestore(&entry->lock, locked);
+
+		if (found)
+			break;
+	}
+	spin_unlock_irqrestore(&bucket->lock, enabled);
+	return found;
+}
+
+/*
+ * Destroys all unused cached entries under dir, dir included. Children
+ * hold references to their parents, so a parent becomes unused only
+ * once its children are gone and the table is scanned until nothing
+ * more can be freed.
+ */
+static void vfs_entry_prune(const struct fs_entry *dir)
+{
+	bool progress = true;
+
+	while (progress) {
+		progress = false;
+		for (size_t i = 0; i != FS_ENTRY_HASH_SIZE; ++i) {
+			struct fs_entry_bucket *bucket = &fs_entry_hash[i];
+			struct fs_entry *entry;
+
+			while ((entry = vfs_entry_unhash_unused(bucket, dir))) {
+				vfs_entry_destroy(entry);
+				progress = true;
+			}
+		}
+	}
+}
+
+/* returns the cached entry for the name without taking a reference */
+static struct fs_entry *vfs_entry_peek(struct fs_entry *dir, const char *name)
+{
+	const unsigned long hash = vfs_name_hash(name);
+	struct fs_entry_bucket *bucket = vfs_entry_bucket(dir, hash);
+	const bool enabled = spin_lock_irqsave(&bucket->lock);
+	struct fs_entry *entry = __vfs_entry_find(bucket, dir, name, hash);
+
+	spin_unlock_irqrestore(&bucket->lock, enabled);
+	return entry;
 }
 
 void vfs_node_destroy(struct fs_node *node)
 { node->ops->release(node); }
 
 
+/* negative entries are returned only if the caller is going to create */
+static struct fs_entry *vfs_lookup_result(struct fs_entry *entry, bool create,
+			int *rc)
+{
+	*rc = entry->node ? 0 : -ENOENT;
+	if (*rc && !create) {
+		vfs_entry_put(entry);
+		return 0;
+	}
+	return entry;
+}
+
+/*
+ * Lookups in a dir run in parallel under the shared side of the dir
+ * rwsem, so an entry is added to the table only after the fs answered
+ * and, if another lookup added the same name first, theirs is used.
+ * Both answers are the same anyway, since creates and removes take the
+ * dir rwsem exclusively.
+ */
 static struct fs_entry *vfs_lookup(struct fs_entry *dir, const char *name,
 			bool create, int *rc)
 {
 	struct fs_node *node = dir->node;
-	struct rb_node **plink = &dir->children.root;
-	struct rb_node *parent = 0;
 
 	if (!node->ops->lookup) {
 		*rc = -ENOTSUP;
 		return 0;
 	}
 
-	const bool enabled = spin_lock_irqsave(&dir->lock);
-
-	while (*plink) {
-		struct fs_entry *entry = TREE_ENTRY(*plink, struct fs_entry,
-			link);
-
-		const int cmp = strcmp(entry->name, name);
+	const unsigned long hash = vfs_name_hash(name);
+	struct fs_entry_bucket *bucket = vfs_entry_bucket(dir, hash);
+	bool enabled = spin_lock_irqsave(&bucket->lock);
+	struct fs_entry *entry = vfs_entry_get(
+				__vfs_entry_find(bucket, dir, name, hash));
 
-		if (!cmp) {
-			*rc = 0;
-			vfs_entry_get(entry);
-			spin_unlock_irqrestore(&dir->lock, enabled);
-			return entry;
-		}
+	spin_unlock_irqrestore(&bucket->lock, enabled);
 
-		parent = *plink;
-		if (cmp < 0)
-			plink = &parent->right;
-		else
-			plink = &parent->left;
+	/* a negative entry saves asking the fs again */
+	if (entry) {
+		++fs_lookup_cached;
+		return vfs_lookup_result(entry, create, rc);
 	}
 
-	struct fs_entry *entry = vfs_entry_create(name);
+	struct fs_entry *created = vfs_entry_create(name, hash);
 
-	if (!entry) {
-		spin_unlock_irqrestore(&dir->lock, enabled);
+	if (!created) {
 		*rc = -ENOMEM;
 		return 0;
 	}
 
-	rb_link(&entry->link, parent, plink);
-	rb_insert(&entry->link, &dir->children);
-	entry->parent = vfs_entry_get(dir);
-	entry->cached = true;
-	spin_unlock_irqrestore(&dir->lock, enabled);
+	created->parent = vfs_entry_get(dir);
+	++fs_lookup_fs;
+	*rc = node->ops->lookup(node, created);
 
-	*rc = node->ops->lookup(node, entry);
-	if (*rc && !create) {
-		vfs_entry_put(entry);
+	/* only a missing name is worth remembering */
+	if (*rc && *rc != -ENOENT) {
+		if (create)
+			return created;
+		vfs_entry_put(created);
 		return 0;
 	}
 
-	return entry;
+	enabled = spin_lock_irqsave(&bucket->lock);
+	entry = vfs_entry_get(__vfs_entry_find(bucket, dir, name, hash));
+	if (!entry) {
+		created->cached = true;
+		list_add_rcu(&created->link, &bucket->entries);
+	}
+	spin_unlock_irqrestore(&bucket->lock, enabled);
+
+	if (entry)
+		vfs_entry_put(created);
+	else
+		entry = created;
+	return vfs_lookup_result(entry, create, rc);
+}
+
+
+/* must be called under rcu_read_lock, returns only positive entries */
+static struct fs_entry *vfs_lookup_rcu(struct fs_entry *dir, const char *name)
+{
+	const unsigned long hash = vfs_name_hash(name);
+	struct fs_entry_bucket *bucket = vfs_entry_bucket(dir, hash);
+
+	for (struct list_head *ptr = bucket->entries.next;
+				ptr != &bucket->entries; ptr = ptr->next) {
+		struct fs_entry *entry = LIST_ENTRY(ptr, struct fs_entry, link);
+
+		if (entry->parent != dir || entry->hash != hash)
+			continue;
+
+		if (entry->node && !strcmp(entry->name, name))
+			return entry;
+	}
+	return 0;
 }
 
 
@@ -148,6 +469,7 @@ struct vfs_walk_data {
 	struct fs_entry *entry;
 	char next[MAX_PATH_LEN];
 	const char *tail;
+	const char *path;
 };
 
 static const char *vfs_path_skip_sep(const char *path)
@@ -159,16 +481,19 @@ static const char *vfs_path_skip_sep(const char *path)
 
 static const char *vfs_path_next_entry(char *next, const char *full)
 {
-	while (*full && *full != '/')
-		*next++ = *full++;
-	*next = '\0';
-	return vfs_path_skip_sep(full);
+	const char *end = strchrnul(full, '/');
+	const size_t len = end - full;
+
+	memcpy(next, full, len);
+	next[len] = '\0';
+	return vfs_path_skip_sep(end);
 }
 
 static void vfs_walk_start(struct vfs_walk_data *data, const char *path)
 {
 	data->entry = vfs_entry_get(&fs_root_entry);
 	data->tail = vfs_path_next_entry(data->next, vfs_path_skip_sep(path));
+	data->path = path;
 }
 
 static void vfs_walk_stop(struct vfs_walk_data *data)
@@ -199,9 +524,9 @@ static int vfs_walk(struct vfs_walk_data *data)
 	struct fs_entry *entry;
 	int rc;
 
-	mutex_lock(&data->entry->node->mux);
+	rwsem_read_lock(&data->entry->node->rwsem);
 	entry = vfs_lookup(data->entry, data->next, false, &rc);
-	mutex_unlock(&data->entry->node->mux);
+	rwsem_read_unlock(&data->entry->node->rwsem);
 
 	if (!entry)
 		return rc;
@@ -212,8 +537,69 @@ static int vfs_walk(struct vfs_walk_data *data)
 	return 0;
 }
 
+/*
+ * RCU-walk: follows cached entries without locks and references, and
+ * takes a reference only on the entry it stops at. It stops at the
+ * first component that isn't cached (or at the parent of the last one
+ * if parent is set), and the ref-walk continues from there. If the
+ * entry it stopped at is being freed the whole walk starts over in
+ * ref-walk mode.
+ */
+static void vfs_walk_rcu(struct vfs_walk_data *data, bool parent)
+{
+	struct fs_entry *entry = data->entry;
+	const bool enabled = rcu_read_lock();
+
+	while (*(parent ? data->tail : data->next)) {
+		const char *name = data->next;
+
+		if (name[0] == '.' && name[1] == '.' && !name[2]) {
+			entry = entry->parent;
+		} else if (name[0] != '.' || name[1]) {
+			struct fs_entry *next = vfs_lookup_rcu(entry, name);
+
+			if (!next)
+				break;
+			entry = next;
+		}
+		data->tail = vfs_path_next_entry(data->next, data->tail);
+	}
+
+	const bool done = !*(parent ? data->tail : data->next);
+
+	if (entry == data->entry) {
+		rcu_read_unlock(enabled);
+		++*(done ? &fs_walk_rcu : &fs_walk_ref);
+		return;
+	}
+
+	const bool alive = vfs_entry_tryget(entry);
+
+	rcu_read_unlock(enabled);
+	++*(done && alive ? &fs_walk_rcu : &fs_walk_ref);
+	vfs_entry_put(data->entry);
+
+	if (alive)
+		data->entry = entry;
+	else
+		vfs_walk_start(data, data->path);
+}
+
+void vfs_walk_stats(unsigned long *rcu, unsigned long *ref)
+{
+	*rcu = fs_walk_rcu;
+	*ref = fs_walk_ref;
+}
+
+void vfs_lookup_stats(unsigned long *cached, unsigned long *fs)
+{
+	*cached = fs_lookup_cached;
+	*fs = fs_lookup_fs;
+}
+
 static int vfs_walk_parent(struct vfs_walk_data *data)
 {
+	vfs_walk_rcu(data, true);
 	while (strcmp(data->tail, "")) {
 		const int rc = vfs_walk(data);
 
@@ -225,6 +611,7 @@ static int vfs_walk_parent(struct vfs_walk_data *data)
 
 static int vfs_walk_all(struct vfs_walk_data *data)
 {
+	vfs_walk_rcu(data, false);
 	while (strcmp(data->next, "")) {
 		const int rc = vfs_walk(data);
 
@@ -332,7 +719,11 @@ static int vfs_file_open(const char *name, struct fs_file *file, bool create)
 		return -ENOTSUP;
 	}
 	
-	mutex_lock(&dir->mux);
+	/* plain open only looks up, so it can share the dir with others */
+	if (create)
+		rwsem_write_lock(&dir->rwsem);
+	else
+		rwsem_read_lock(&dir->rwsem);
 	entry = vfs_lookup(wd.entry, wd.next, create, &rc);
 	if (create && entry && !entry->node) {
 		if (!dir->ops->create)
@@ -340,7 +731,10 @@ static int vfs_file_open(const char *name, struct fs_file *file, bool create)
 		else
 			rc = dir->ops->create(dir, entry);
 	}
-	mutex_unlock(&dir->mux);
+	if (create)
+		rwsem_write_unlock(&dir->rwsem);
+	else
+		rwsem_read_unlock(&dir->rwsem);
 	vfs_walk_stop(&wd);
 
 	if (rc) {
@@ -495,18 +889,18 @@ int vfs_link(const char *oldname, const char *newname)
 		return -ENOTSUP;
 	}
 	
-	mutex_lock(&node->mux);
+	rwsem_write_lock(&node->rwsem);
 	struct fs_entry *newentry = vfs_lookup(dir, wd.next, true, &rc);
 
 	if (!newentry) {
-		mutex_unlock(&node->mux);
+		rwsem_write_unlock(&node->rwsem);
 		vfs_walk_stop(&wd);
 		vfs_entry_put(oldentry);
 		return rc;
 	}
 
 	if (newentry->node) {
-		mutex_unlock(&node->mux);
+		rwsem_write_unlock(&node->rwsem);
 		vfs_walk_stop(&wd);
 		vfs_entry_put(oldentry);
 		vfs_entry_put(newentry);
@@ -514,7 +908,7 @@ int vfs_link(const char *oldname, const char *newname)
 	}
 
 	rc = node->ops->link(oldentry, node, newentry);
-	mutex_unlock(&node->mux);
+	rwsem_write_unlock(&node->rwsem);
 	vfs_walk_stop(&wd);
 	vfs_entry_put(oldentry);
 	vfs_entry_put(newentry);
@@ -537,9 +931,9 @@ int vfs_unlink(const char *name)
 		return -ENOTSUP;
 	}
 
-	mutex_lock(&node->mux);
+	rwsem_write_lock(&node->rwsem);
 	rc = node->ops->unlink(node, entry);
-	mutex_unlock(&node->mux);
+	rwsem_write_unlock(&node->rwsem);
 	vfs_entry_put(entry);
 	return rc;
 }
@@ -564,24 +958,24 @@ int vfs_mkdir(const char *name)
 		return -ENOTSUP;
 	}
 
-	mutex_lock(&node->mux);
+	rwsem_write_lock(&node->rwsem);
 	struct fs_entry *entry = vfs_lookup(dir, wd.next, true, &rc);
 
 	if (!entry) {
-		mutex_unlock(&node->mux);
+		rwsem_write_unlock(&node->rwsem);
 		vfs_walk_stop(&wd);
 		return rc;
 	}
 
 	if (entry->node) {
-		mutex_unlock(&node->mux);
+		rwsem_write_unlock(&node->rwsem);
 		vfs_walk_stop(&wd);
 		vfs_entry_put(entry);
 		return -EEXIST;
 	}
 
 	rc = node->ops->mkdir(node, entry);
-	mutex_unlock(&node->mux);
+	rwsem_write_unlock(&node->rwsem);
 	vfs_walk_stop(&wd);
 	vfs_entry_put(entry);
 	return rc;
@@ -603,9 +997,9 @@ int vfs_rmdir(const char *name)
 		return -ENOTSUP;
 	}
 
-	mutex_lock(&node->mux);
+	rwsem_write_lock(&node->rwsem);
 	rc = node->ops->rmdir(node, entry);
-	mutex_unlock(&node->mux);
+	rwsem_write_unlock(&node->rwsem);
 	vfs_entry_put(entry);
 	return rc;
 }
@@ -666,25 +1060,25 @@ static void __vfs_mount_destroy(struct fs_type *fs, struct fs_mount *mnt)
 
 int register_filesystem(struct fs_type *type)
 {
-	mutex_lock(&fs_root_node.mux);
+	rwsem_write_lock(&fs_root_node.rwsem);
 	if (__vfs_lookup_filesystem(type->name)) {
-		mutex_unlock(&fs_root_node.mux);
+		rwsem_write_unlock(&fs_root_node.rwsem);
 		return -EEXIST;
 	}
 	list_add_tail(&type->link, &fs_types);
-	mutex_unlock(&fs_root_node.mux);
+	rwsem_write_unlock(&fs_root_node.rwsem);
 	return 0;
 }
 
 int unregister_filesystem(struct fs_type *type)
 {
-	mutex_lock(&fs_root_node.mux);
+	rwsem_write_lock(&fs_root_node.rwsem);
 	if (type->refcount) {
-		mutex_unlock(&fs_root_node.mux);
+		rwsem_write_unlock(&fs_root_node.rwsem);
 		return -EBUSY;
 	}
 	list_del(&type->link);
-	mutex_unlock(&fs_root_node.mux);
+	rwsem_write_unlock(&fs_root_node.rwsem);
 	return 0;
 }
 
@@ -713,15 +1107,16 @@ static int __vfs_mount(const char *fs_name, const char *mount, const void *data,
 
 	list_add_tail(&mnt->link, &fs_mounts);
 	++fs->refcount;
+	vfs_entry_invalidate(&fs_root_entry, mount);
 	return ret;
 }
 
 int vfs_mount(const char *fs_name, const char *mount, const void *data,
 			size_t size)
 {
-	mutex_lock(&fs_root_node.mux);
+	rwsem_write_lock(&fs_root_node.rwsem);
 	const int rc = __vfs_mount(fs_name, mount, data, size);
-	mutex_unlock(&fs_root_node.mux);
+	rwsem_write_unlock(&fs_root_node.rwsem);
 	return rc;
 }
 
@@ -732,6 +1127,15 @@ static int __vfs_umount(const char *mount)
 	if (!mnt)
 		return -ENOENT;
 
+	/* cached entries pin nodes of the fs, so they must go first */
+	struct fs_entry *root = vfs_entry_peek(&fs_root_entry, mount);
+
+	if (root) {
+		vfs_entry_prune(root);
+		if (vfs_entry_peek(&fs_root_entry, mount))
+			return -EBUSY;
+	}
+
 	list_del(&mnt->link);
 	mnt->fs->ops->umount(mnt);
 	--mnt->fs->refcount;
@@ -741,9 +1145,9 @@ static int __vfs_umount(const char *mount)
 
 int vfs_umount(const char *mount)
 {
-	mutex_lock(&fs_root_node.mux);
+	rwsem_write_lock(&fs_root_node.rwsem);
 	const int rc = __vfs_umount(mount);
-	mutex_unlock(&fs_root_node.mux);
+	rwsem_write_unlock(&fs_root_node.rwsem);
 	return rc;	
 }
 
@@ -751,11 +1155,18 @@ void setup_vfs(void)
 {
 	DBG_ASSERT((fs_entry_cache = KMEM_CACHE(struct fs_entry)) != 0);
 
-	mutex_init(&fs_root_node.mux);
+	for (size_t i = 0; i != FS_ENTRY_HASH_SIZE; ++i) {
+		list_init(&fs_entry_hash[i].entries);
+		spinlock_init(&fs_entry_hash[i].lock);
+	}
+
+	rwsem_init(&fs_root_node.rwsem);
 	fs_root_node.ops = &fs_root_node_ops;
 	fs_root_node.fops = &fs_root_file_ops;
 
+	list_init(&fs_root_entry.lru);
 	fs_root_entry.node = &fs_root_node;
 	fs_root_entry.parent = &fs_root_entry;
 	fs_root_entry.refcount = 1;
+	register_shrinker(&fs_entry_shrinker);
 }
@@ -5,8 +5,8 @@
 #include <stddef.h>
 
 #include "locking.h"
-#include "rbtree.h"
 #include "stdio.h"
+#include "rcu.h"
 #include "list.h"
 
 #define MAX_PATH_LEN 256
@@ -32,6 +32,7 @@ struct fs_node_ops {
 	int (*mkdir)(struct fs_node *, struct fs_entry *);
 	int (*rmdir)(struct fs_node *, struct fs_entry *);
 	int (*lookup)(struct fs_node *, struct fs_entry *);
+	int (*readpage)(struct fs_node *, size_t, void *);
 	void (*release)(struct fs_node *);
 };
 
@@ -75,7 +76,7 @@ struct fs_mount {
  * filesystem entity (file, directory, etc..) there is an fs_node
  */
 struct fs_node {
-	struct mutex mux; // protects against concurrent dir ops
+	struct rwsem rwsem; // dir ops and file i/o, lookups and reads share it
 	struct fs_node_ops *ops;
 	struct fs_file_ops *fops;
 	struct spinlock lock; // protects refcount access, and probably size
@@ -87,7 +88,7 @@ void vfs_node_destroy(struct fs_node *node);
 
 static inline void vfs_node_init(struct fs_node *node)
 {
-	mutex_init(&node->mux);
+	rwsem_init(&node->rwsem);
 	spinlock_init(&node->lock);
 	node->refcount = 1;
 }
@@ -119,15 +120,23 @@ static inline void vfs_node_put(struct fs_node *node)
  * struct fs_entry represents chunk of file path, for example for
  * a path /usr/bin/python there might be three fs_entry structures:
  * usr, bin and python. So fs_entry structures reperesents a tree
- * of dirs.
+ * of dirs. Cached entries are kept in a global hash table keyed by
+ * the parent and the hash of the name. The table is also walked
+ * without locks under rcu_read_lock, so entries are freed with
+ * call_rcu, and link, parent, hash, name don't change after the entry
+ * has been added to the table. An entry without node is negative, it
+ * remembers that the name doesn't exist. Cached entries nobody holds
+ * a reference to stay in the table on an LRU list until evicted.
  */
 struct fs_entry {
-	struct rb_node link; // protected by parent->node->mux
-	struct rb_tree children; // protected by node->mux
+	struct list_head link; // protected by the hash bucket lock
+	struct list_head lru; // protected by the LRU lock
+	struct rcu_head rcu;
 	struct fs_entry *parent;
 	struct fs_node *node;
+	unsigned long hash;
 	char name[MAX_PATH_LEN];
-	bool cached; // protected by parent->node->mux
+	bool cached; // protected by the hash bucket and entry locks
 	struct spinlock lock; // protects refcount access
 	int refcount;
 };
@@ -136,6 +145,11 @@ void vfs_entry_detach(struct fs_entry *entry);
 struct fs_entry *vfs_entry_get(struct fs_entry *entry);
 void vfs_entry_put(struct fs_entry *entry);
 
+/* walks done without locks and those that needed ref-walk for a part */
+void vfs_walk_stats(unsigned long *rcu, unsigned long *ref);
+/* ref-walk lookups answered by cached entries and those that asked the fs */
+void vfs_lookup_stats(unsigned long *cached, unsigned long *fs);
+
 
 /**
  * struct fs_file is so called file description
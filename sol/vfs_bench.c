@@ -0,0 +1,103 @@
+#include "kernel.h"
+#include "string.h"
+#include "stdio.h"
+#include "time.h"
+#include "vfs.h"
+
+#define VFS_BENCH_ROOT    "/initramfs"
+#define VFS_BENCH_PATHS   64
+#define VFS_BENCH_LOOKUPS 1000000
+#define VFS_BENCH_DEPTH   8
+
+
+/* paths found in the initramfs, directories are scanned in bfs order */
+static char vfs_bench_path[VFS_BENCH_PATHS][MAX_PATH_LEN];
+static int vfs_bench_paths;
+
+static void vfs_bench_add(const char *dir, const char *name)
+{
+	char *path = vfs_bench_path[vfs_bench_paths];
+	const size_t len = strlen(dir);
+
+	if (len + strlen(name) + 2 > MAX_PATH_LEN)
+		return;
+
+	strcpy(path, dir);
+	path[len] = '/';
+	strcpy(path + len + 1, name);
+	++vfs_bench_paths;
+}
+
+static void vfs_bench_collect(void)
+{
+	static struct dirent entry;
+
+	strcpy(vfs_bench_path[0], VFS_BENCH_ROOT);
+	vfs_bench_paths = 1;
+
+	for (int i = 0; i != vfs_bench_paths; ++i) {
+		struct fs_file file;
+
+		if (vfs_open(vfs_bench_path[i], &file))
+			continue;
+
+		while (vfs_bench_paths != VFS_BENCH_PATHS
+				&& vfs_readdir(&file, &entry, 1) == 1)
+			vfs_bench_add(vfs_bench_path[i], entry.name);
+		vfs_release(&file);
+	}
+}
+
+/* an empty initramfs still gets a deep path to resolve */
+static void vfs_bench_populate(void)
+{
+	char path[MAX_PATH_LEN];
+	struct fs_file file;
+
+	strcpy(path, VFS_BENCH_ROOT);
+	for (int i = 0; i != VFS_BENCH_DEPTH; ++i) {
+		strcpy(path + strlen(path), "/vfs_bench_dir");
+		vfs_mkdir(path);
+	}
+
+	strcpy(path + strlen(path), "/file");
+	if (!vfs_create(path, &file))
+		vfs_release(&file);
+}
+
+void vfs_bench(void)
+{
+	DBG_INFO("Start vfs path lookup benchmark");
+
+	vfs_bench_collect();
+	if (vfs_bench_paths == 1) {
+		vfs_bench_populate();
+		vfs_bench_collect();
+	}
+
+	const unsigned long long ticks = jiffies;
+	const unsigned long long cycles = rdtsc();
+	unsigned long long failed = 0;
+
+	for (int i = 0; i != VFS_BENCH_LOOKUPS; ++i) {
+		struct fs_file file;
+
+		if (vfs_open(vfs_bench_path[i % vfs_bench_paths], &file))
+			++failed;
+		else
+			vfs_release(&file);
+	}
+
+	const unsigned long long elapsed = rdtsc() - cycles;
+	const unsigned long long ms = (jiffies - ticks) * 1000 / HZ;
+	unsigned long rcu, ref;
+
+	DBG_INFO("%d lookups over %d paths: %llu cycles/lookup, %llu ms",
+		VFS_BENCH_LOOKUPS, vfs_bench_paths,
+		elapsed / VFS_BENCH_LOOKUPS, ms);
+	vfs_walk_stats(&rcu, &ref);
+	DBG_INFO("walks: %lu lockless, %lu with ref-walk", rcu, ref);
+	if (failed)
+		DBG_ERR("%llu lookups failed", failed);
+	DBG_INFO("vfs path lookup benchmark finished");
+}